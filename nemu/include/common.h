@@ -44,6 +44,19 @@ typedef MUXDEF(PMEM64, uint64_t, uint32_t) paddr_t;
 #define FMT_PADDR MUXDEF(PMEM64, "0x%016" PRIx64, "0x%08" PRIx32)
 typedef uint16_t ioaddr_t;
 
+#ifdef CONFIG_NR_HART
+#define NR_HART CONFIG_NR_HART
+#else
+#define NR_HART 1
+#endif
+
+// the state private to each hart, which is per host thread if harts run in parallel
+#ifdef CONFIG_HART_THREAD
+#define HART_LOCAL __thread
+#else
+#define HART_LOCAL
+#endif
+
 #include <debug.h>
 
 #endif
@@ -0,0 +1,69 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#ifndef __CPU_DCACHE_H__
+#define __CPU_DCACHE_H__
+
+#include <common.h>
+
+// a pre-decoded instruction, which is enough to run its execution body again
+typedef struct {
+  vaddr_t pc;
+  uint32_t inst;
+  const void *handler; // label of the execution body inside decode_exec()
+  uint8_t rd, rs1, rs2;
+  word_t imm;
+} DecodeCacheEntry;
+
+#ifdef CONFIG_DCACHE
+
+#define DCACHE_SIZE (1 << CONFIG_DCACHE_BITS)
+
+// Each hart has its own cache, and only sees the writes to instructions by
+// other harts after fence.i, which is what the ISA requires.
+extern HART_LOCAL DecodeCacheEntry dcache[DCACHE_SIZE];
+extern HART_LOCAL uint64_t dcache_nr_hit;
+
+static inline DecodeCacheEntry* dcache_lookup(vaddr_t pc) {
+  DecodeCacheEntry *e = &dcache[(pc >> 2) & (DCACHE_SIZE - 1)];
+  if (likely(e->pc == pc && e->handler != NULL)) {
+    dcache_nr_hit ++;
+    return e;
+  }
+  return NULL;
+}
+
+void dcache_fill(vaddr_t pc, uint32_t inst, const void *handler,
+    int rd, int rs1, int rs2, word_t imm);
+void dcache_flush();
+void dcache_statistic();
+
+// Called on every write to pmem. Since the cache is direct-mapped, an
+// instruction at `pc` can only be cached in one entry, so checking the
+// entries of the written words is enough to drop all stale instructions.
+static inline void dcache_invalidate(paddr_t addr, int len) {
+  vaddr_t pc;
+  for (pc = addr & ~(vaddr_t)3; pc <= addr + len - 1; pc += 4) {
+    DecodeCacheEntry *e = &dcache[(pc >> 2) & (DCACHE_SIZE - 1)];
+    if (unlikely(e->pc == pc)) e->handler = NULL;
+  }
+}
+
+#else
+static inline void dcache_invalidate(paddr_t addr, int len) {}
+static inline void dcache_flush() {}
+#endif
+
+#endif
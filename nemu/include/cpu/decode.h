@@ -23,7 +23,6 @@ typedef struct Decode {
   vaddr_t snpc; // static next pc
   vaddr_t dnpc; // dynamic next pc
   ISADecodeInfo isa;
-  IFDEF(CONFIG_ITRACE, char logbuf[128]);
 } Decode;
 
 // --- pattern matching mechanism ---
@@ -86,17 +85,116 @@ finish:
 }
 
 
+// --- decode tree ---
+// The patterns of a table are registered by running the table once in the
+// probing mode. Then they are distributed into buckets selected by the bits
+// in INSTPAT_BUCKET_MASK (defined in isa-def.h), which should consist of at
+// most two contiguous fields, e.g. opcode and funct3. Decoding an instruction
+// only scans the patterns in its bucket, in the same order as the table.
+#ifdef CONFIG_DECODE_TREE
+
+#define INSTPAT_MAX 512
+#define INSTPAT_BUCKET_MAX_BITS 12
+#define INSTPAT_CHAIN_MAX 16384
+
+enum { INSTPAT_TREE_EMPTY, INSTPAT_TREE_PROBING, INSTPAT_TREE_READY };
+
+typedef struct {
+  uint64_t key, mask, shift;
+  const void *body; // label of the execution body of the pattern
+} InstPat;
+
+typedef struct {
+  int state;
+  int nr_pat;
+  InstPat pat[INSTPAT_MAX];
+  // `chain + bucket[b]` is the list of indices into `pat` of bucket `b`,
+  // terminated by -1
+  uint16_t bucket[1 << INSTPAT_BUCKET_MAX_BITS];
+  int16_t chain[INSTPAT_CHAIN_MAX];
+} InstPatTree;
+
+__attribute__((always_inline))
+static inline uint32_t instpat_bucket(uint64_t inst, uint64_t bmask) {
+  int lo0 = __builtin_ctzll(bmask);
+  int w0 = __builtin_ctzll(~(bmask >> lo0));
+  uint32_t b = (inst >> lo0) & BITMASK(w0);
+  uint64_t rest = (bmask >> lo0) >> w0;
+  if (rest != 0) {
+    int lo1 = __builtin_ctzll(rest) + lo0 + w0;
+    int w1 = __builtin_ctzll(~(bmask >> lo1));
+    b |= ((inst >> lo1) & BITMASK(w1)) << w0;
+  }
+  return b;
+}
+
+__attribute__((always_inline))
+static inline const void* instpat_tree_lookup(InstPatTree *t, uint64_t inst, uint64_t bmask) {
+  const int16_t *p = t->chain + t->bucket[instpat_bucket(inst, bmask)];
+  for (; *p >= 0; p ++) {
+    InstPat *pat = &t->pat[*p];
+    if (((inst >> pat->shift) & pat->mask) == pat->key) return pat->body;
+  }
+  return NULL;
+}
+
+void instpat_tree_add(InstPatTree *t, uint64_t key, uint64_t mask, uint64_t shift, const void *body);
+void instpat_tree_build(InstPatTree *t, uint64_t bmask);
+// The first decoding builds the tree while holding this lock, so that the
+// harts running in threads neither build it twice nor use it half built.
+void instpat_tree_lock();
+void instpat_tree_unlock();
+
+#define INSTPAT_TREE_PROBE(key, mask, shift) \
+  if (unlikely(__instpat_tree.state == INSTPAT_TREE_PROBING)) { \
+    instpat_tree_add(&__instpat_tree, key, mask, shift, &&concat(__instpat_body_, __LINE__)); \
+    break; \
+  }
+#define INSTPAT_TREE_BODY concat(__instpat_body_, __LINE__):
+#define INSTPAT_TREE_START(name) \
+  static InstPatTree __instpat_tree = {}; \
+  concat(__instpat_start_, name): \
+  if (likely(__atomic_load_n(&__instpat_tree.state, __ATOMIC_ACQUIRE) == INSTPAT_TREE_READY)) { \
+    const void *__body = instpat_tree_lookup(&__instpat_tree, INSTPAT_INST(s), INSTPAT_BUCKET_MASK); \
+    if (likely(__body != NULL)) goto *__body; \
+  } else { \
+    instpat_tree_lock(); \
+    if (__instpat_tree.state == INSTPAT_TREE_READY) { \
+      instpat_tree_unlock(); \
+      goto concat(__instpat_start_, name); \
+    } \
+    __instpat_tree.state = INSTPAT_TREE_PROBING; \
+  }
+#define INSTPAT_TREE_END(name) \
+  if (unlikely(__instpat_tree.state == INSTPAT_TREE_PROBING)) { \
+    instpat_tree_build(&__instpat_tree, INSTPAT_BUCKET_MASK); \
+    instpat_tree_unlock(); \
+    goto concat(__instpat_start_, name); \
+  }
+
+#else
+#define INSTPAT_TREE_PROBE(key, mask, shift)
+#define INSTPAT_TREE_BODY
+#define INSTPAT_TREE_START(name)
+#define INSTPAT_TREE_END(name)
+#endif
+
 // --- pattern matching wrappers for decode ---
 #define INSTPAT(pattern, ...) do { \
   uint64_t key, mask, shift; \
   pattern_decode(pattern, STRLEN(pattern), &key, &mask, &shift); \
+  INSTPAT_TREE_PROBE(key, mask, shift); \
   if ((((uint64_t)INSTPAT_INST(s) >> shift) & mask) == key) { \
+    INSTPAT_TREE_BODY; \
     INSTPAT_MATCH(s, ##__VA_ARGS__); \
     goto *(__instpat_end); \
   } \
 } while (0)
 
-#define INSTPAT_START(name) { const void ** __instpat_end = &&concat(__instpat_end_, name);
-#define INSTPAT_END(name)   concat(__instpat_end_, name): ; }
+// `__instpat_end` is static, so it is also valid when jumping directly into
+// an execution body (e.g. from the decoded-instruction cache)
+#define INSTPAT_START(name) { static const void * __instpat_end = &&concat(__instpat_end_, name); \
+  INSTPAT_TREE_START(name)
+#define INSTPAT_END(name)   INSTPAT_TREE_END(name) concat(__instpat_end_, name): ; }
 
 #endif
@@ -0,0 +1,44 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+
+#ifndef __CPU_INVALIDATE_H__
+#define __CPU_INVALIDATE_H__
+
+#include <cpu/dcache.h>
+#include <cpu/jit.h>
+#include <cpu/tblock.h>
+#include <memory/paddr.h>
+#include <memory/vaddr.h>
+
+// Called on every write to pmem, drop the translated instructions which are
+// going to be overwritten.
+static inline void code_invalidate(paddr_t addr, int len) {
+  dcache_invalidate(addr, len);
+  tblock_invalidate(addr, len);
+  jit_invalidate(addr, len);
+}
+
+// Drop all translated instructions when pmem is replaced as a whole.
+static inline void code_invalidate_all() {
+  paddr_t addr;
+  dcache_flush();
+  for (addr = PMEM_LEFT; addr - CONFIG_MBASE < CONFIG_MSIZE; addr += PAGE_SIZE) {
+    tblock_invalidate(addr, PAGE_SIZE);
+    jit_invalidate(addr, PAGE_SIZE);
+  }
+}
+
+#endif
@@ -0,0 +1,179 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#ifndef __CPU_JIT_H__
+#define __CPU_JIT_H__
+
+#include <common.h>
+
+// code optimized by LLVM, which runs a whole block with the arguments
+// (&cpu, host address of pmem, jit_code_page) and returns the number of
+// instructions run
+typedef uint32_t (*jit_opt_t)(void *cpu, uint8_t *pmem, uint8_t *code_page);
+
+// A guest basic block translated into x86-64 host code. The host code runs
+// with the following registers set up by the entry trampoline:
+//   rbx = &cpu, r12 = &jit_budget, r13 = host address of pmem,
+//   r14 = jit_code_page
+// and returns to `jit_exit` with rax = the block to chain from (or NULL).
+typedef struct JitBlock {
+  vaddr_t pc;
+  vaddr_t end;          // pc of the instruction after the block
+  uint32_t nr_inst;
+  uint8_t *code;        // entry of the host code
+  uint8_t *inval;       // stub to exit with cpu.pc = pc, the entry is
+                        // patched to jump here when the block is dropped
+  uint8_t *chain;       // rel32 of the jump to the successor, or NULL
+  uint32_t *count;      // number of times the block is entered
+  jit_opt_t opt;        // the code optimized by LLVM, or NULL
+  struct JitBlock *hash_next;
+  struct JitBlock *page_next;
+} JitBlock;
+
+#ifdef CONFIG_ENGINE_JIT
+#include <memory/paddr.h>
+#include <memory/vaddr.h>
+
+extern int64_t jit_budget;
+extern bool jit_stop;
+extern uint8_t jit_code_page[CONFIG_MSIZE >> PAGE_SHIFT];
+extern uint8_t *jit_exit;
+
+void jit_invalidate_page(uint32_t page, paddr_t addr, int len);
+uint64_t jit_exec(uint64_t n);
+void jit_statistic();
+
+// helpers called by the host code
+bool jit_interp(vaddr_t pc);
+word_t jit_load(vaddr_t addr, int len);
+bool jit_store(vaddr_t addr, int len, word_t data);
+
+// implemented by the ISA, emit the host code of `b` to `p`, return the end
+// of the code, or NULL if it would go beyond `end`
+uint8_t* isa_jit_translate(JitBlock *b, uint8_t *p, uint8_t *end);
+
+#ifdef CONFIG_JIT_LLVM
+#include <llvm-c/Core.h>
+
+// The entry of a block exits with the block tagged by JIT_HOT when it has
+// been entered JIT_HOT_THRESHOLD times, then the block is compiled by LLVM.
+#define JIT_HOT 1
+#define JIT_HOT_THRESHOLD 4096
+
+jit_opt_t jit_llvm_compile(JitBlock *b);
+void jit_llvm_flush();
+void jit_llvm_statistic();
+
+// implemented by the ISA, emit the IR of `b` as function `name` in `m`
+void isa_jit_lift(JitBlock *b, LLVMModuleRef m, const char *name);
+#endif
+
+// called on every write to pmem, drop the blocks overlapping with the written bytes
+static inline void jit_invalidate(paddr_t addr, int len) {
+  uint32_t first = (addr - CONFIG_MBASE) >> PAGE_SHIFT;
+  uint32_t last = (addr + len - 1 - CONFIG_MBASE) >> PAGE_SHIFT;
+  if (unlikely(jit_code_page[first])) jit_invalidate_page(first, addr, len);
+  if (unlikely(last != first && in_pmem(addr + len - 1) && jit_code_page[last])) {
+    jit_invalidate_page(last, addr, len);
+  }
+}
+
+// --- x86-64 code emitter ---
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI };
+
+static inline void jit_emit8(uint8_t **p, uint8_t x) { *(*p) ++ = x; }
+static inline void jit_emit32(uint8_t **p, uint32_t x) { memcpy(*p, &x, 4); *p += 4; }
+static inline void jit_emit64(uint8_t **p, uint64_t x) { memcpy(*p, &x, 8); *p += 8; }
+
+// point the rel32 at `at` to `target`
+static inline void jit_patch_rel32(uint8_t *at, const void *target) {
+  int32_t rel = (uint8_t *)target - (at + 4);
+  memcpy(at, &rel, 4);
+}
+
+// jmp rel32, return the address of rel32
+static inline uint8_t* jit_emit_jmp(uint8_t **p, const void *target) {
+  jit_emit8(p, 0xe9);
+  uint8_t *rel = *p;
+  jit_emit32(p, 0);
+  jit_patch_rel32(rel, target);
+  return rel;
+}
+
+// jcc rel32 with condition code `cc`, return the address of rel32
+static inline uint8_t* jit_emit_jcc(uint8_t **p, uint8_t cc, const void *target) {
+  jit_emit8(p, 0x0f); jit_emit8(p, 0x80 | cc);
+  uint8_t *rel = *p;
+  jit_emit32(p, 0);
+  if (target != NULL) jit_patch_rel32(rel, target);
+  return rel;
+}
+#define JIT_CC_B  0x2
+#define JIT_CC_AE 0x3
+#define JIT_CC_E  0x4
+#define JIT_CC_NE 0x5
+#define JIT_CC_L  0xc
+
+// mov r32, [rbx + disp]
+static inline void jit_emit_ld_cpu(uint8_t **p, int r, uint32_t disp) {
+  jit_emit8(p, 0x8b); jit_emit8(p, 0x83 | (r << 3)); jit_emit32(p, disp);
+}
+
+// mov [rbx + disp], r32
+static inline void jit_emit_st_cpu(uint8_t **p, int r, uint32_t disp) {
+  jit_emit8(p, 0x89); jit_emit8(p, 0x83 | (r << 3)); jit_emit32(p, disp);
+}
+
+// mov dword [rbx + disp], imm32
+static inline void jit_emit_st_cpu_imm(uint8_t **p, uint32_t disp, uint32_t imm) {
+  jit_emit8(p, 0xc7); jit_emit8(p, 0x83); jit_emit32(p, disp); jit_emit32(p, imm);
+}
+
+// mov r32, imm32
+static inline void jit_emit_mov_imm(uint8_t **p, int r, uint32_t imm) {
+  if (imm == 0) { jit_emit8(p, 0x31); jit_emit8(p, 0xc0 | (r << 3) | r); } // xor r32, r32
+  else { jit_emit8(p, 0xb8 | r); jit_emit32(p, imm); }
+}
+
+// mov dst32, src32
+static inline void jit_emit_mov(uint8_t **p, int dst, int src) {
+  jit_emit8(p, 0x89); jit_emit8(p, 0xc0 | (src << 3) | dst);
+}
+
+// add/sub/cmp r32, imm32, `op` is the ModRM.reg field of opcode 0x81
+#define JIT_OP_ADD 0
+#define JIT_OP_SUB 5
+#define JIT_OP_CMP 7
+static inline void jit_emit_alu_imm(uint8_t **p, int op, int r, uint32_t imm) {
+  jit_emit8(p, 0x81); jit_emit8(p, 0xc0 | (op << 3) | r); jit_emit32(p, imm);
+}
+
+// add/sub qword [r12], imm32
+static inline void jit_emit_budget(uint8_t **p, int op, uint32_t imm) {
+  jit_emit8(p, 0x49); jit_emit8(p, 0x81); jit_emit8(p, 0x04 | (op << 3));
+  jit_emit8(p, 0x24); jit_emit32(p, imm);
+}
+
+// movabs rax, imm64; call rax
+static inline void jit_emit_call(uint8_t **p, const void *fn) {
+  jit_emit8(p, 0x48); jit_emit8(p, 0xb8); jit_emit64(p, (uintptr_t)fn);
+  jit_emit8(p, 0xff); jit_emit8(p, 0xd0);
+}
+
+#else
+static inline void jit_invalidate(paddr_t addr, int len) {}
+#endif
+
+#endif
@@ -0,0 +1,71 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#ifndef __CPU_TBLOCK_H__
+#define __CPU_TBLOCK_H__
+
+#include <cpu/decode.h>
+
+// max number of instructions in a translation block
+#define TBLOCK_MAX_INST 64
+
+// a pre-decoded instruction in a translation block
+typedef struct TInst {
+  const void *handler; // label of the execution body inside decode_exec()
+  Decode s;            // `pc` and `snpc` are set when translating
+  uint8_t rd, rs1, rs2;
+  word_t imm;
+} TInst;
+
+// A guest basic block translated into an array of pre-decoded instructions,
+// which is run by the direct-threaded dispatch loop in decode_exec().
+// A block never crosses a page boundary.
+typedef struct TBlock {
+  vaddr_t pc;
+  uint32_t nr_inst;
+  struct TBlock *hash_next;
+  struct TBlock *page_next;
+  TInst inst[];
+} TBlock;
+
+#ifdef CONFIG_ENGINE_THREADED
+#include <memory/paddr.h>
+#include <memory/vaddr.h>
+
+// set when the running block is invalidated, the dispatch loop should stop
+extern bool tblock_stop;
+extern uint8_t tblock_code_page[CONFIG_MSIZE >> PAGE_SHIFT];
+
+void tblock_invalidate_page(uint32_t page, paddr_t addr, int len);
+uint64_t tblock_exec(uint64_t n);
+
+// implemented by the ISA
+bool isa_tinst_translate(TInst *t, vaddr_t pc);
+uint32_t isa_tblock_exec(TBlock *tb, uint32_t n);
+
+// called on every write to pmem, drop the blocks overlapping with the written bytes
+static inline void tblock_invalidate(paddr_t addr, int len) {
+  uint32_t first = (addr - CONFIG_MBASE) >> PAGE_SHIFT;
+  uint32_t last = (addr + len - 1 - CONFIG_MBASE) >> PAGE_SHIFT;
+  if (unlikely(tblock_code_page[first])) tblock_invalidate_page(first, addr, len);
+  if (unlikely(last != first && in_pmem(addr + len - 1) && tblock_code_page[last])) {
+    tblock_invalidate_page(last, addr, len);
+  }
+}
+#else
+static inline void tblock_invalidate(paddr_t addr, int len) {}
+#endif
+
+#endif
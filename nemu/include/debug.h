@@ -27,6 +27,8 @@
 #define Assert(cond, format, ...)                                              \
     do {                                                                       \
         if (!(cond)) {                                                         \
+            IFDEF(CONFIG_SERIAL_BUFFERED,                                      \
+                  extern void serial_flush(); serial_flush());                 \
             MUXDEF(CONFIG_TARGET_AM,                                           \
                    printf(ANSI_FMT(format, ANSI_FG_RED) "\n", ##__VA_ARGS__),  \
                    (fflush(stdout),                                            \
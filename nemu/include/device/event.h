@@ -0,0 +1,58 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#ifndef __DEVICE_EVENT_H__
+#define __DEVICE_EVENT_H__
+
+#include <common.h>
+
+#define TIMER_HZ 60
+
+// The clocks to schedule events on. EVENT_INST counts the instructions
+// executed by hart 0, EVENT_HOST is get_time() in us.
+enum { EVENT_INST, EVENT_HOST, NR_EVENT_CLOCK };
+
+// the clock of the guest time returned by get_guest_time()
+#define EVENT_GUEST MUXDEF(CONFIG_ICOUNT, EVENT_INST, EVENT_HOST)
+// the length of 1/hz second of guest time on EVENT_GUEST
+#define EVENT_GUEST_PERIOD(hz) \
+  MUXDEF(CONFIG_ICOUNT, CONFIG_ICOUNT_FREQ / (hz), 1000000 / (hz))
+
+typedef void (*event_handler_t)(void *arg);
+
+typedef struct {
+  const char *name;
+  int clock;
+  event_handler_t handler;
+  void *arg;
+  uint64_t when;
+  uint64_t period;
+  uint64_t nr_fire;
+  int pos; // index in the queue of `clock`, -1 if not pending
+} Event;
+
+void event_init(Event *e, const char *name, int clock, event_handler_t handler, void *arg);
+// Call the handler of `e` once the clock of `e` reaches `when`, replacing
+// the pending one. If `period` is not 0, call it again every `period` after
+// that, skipping the periods which are already over.
+void event_schedule(Event *e, uint64_t when, uint64_t period);
+void event_cancel(Event *e);
+uint64_t event_now(int clock);
+// Call the handlers of the events which are due and set the next deadline.
+void event_run();
+void event_snapshot_add();
+void event_display();
+
+#endif
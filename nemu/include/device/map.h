@@ -28,29 +28,25 @@ typedef struct {
   paddr_t high;
   void *space;
   io_callback_t callback;
+  bool passive; // plain memory without side effects
+  uint64_t nr_access;
 } IOMap;
 
 static inline bool map_inside(IOMap *map, paddr_t addr) {
   return (addr >= map->low && addr <= map->high);
 }
 
-static inline int find_mapid_by_addr(IOMap *maps, int size, paddr_t addr) {
-  int i;
-  for (i = 0; i < size; i ++) {
-    if (map_inside(maps + i, addr)) {
-      difftest_skip_ref();
-      return i;
-    }
-  }
-  return -1;
-}
-
 void add_pio_map(const char *name, ioaddr_t addr,
         void *space, uint32_t len, io_callback_t callback);
 void add_mmio_map(const char *name, paddr_t addr,
         void *space, uint32_t len, io_callback_t callback);
+// `dirty` is NULL, or the dirty map of the region, see device/mmio.h
+void add_mmio_mem(const char *name, paddr_t addr, void *space, uint32_t len,
+    uint8_t *dirty);
 
 word_t map_read(paddr_t addr, int len, IOMap *map);
 void map_write(paddr_t addr, int len, word_t data, IOMap *map);
+void map_display(IOMap *maps, int nr_map);
+void map_snapshot_add();
 
 #endif
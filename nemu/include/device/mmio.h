@@ -20,5 +20,62 @@
 
 word_t mmio_read(paddr_t addr, int len);
 void mmio_write(paddr_t addr, int len, word_t data);
+// return the number of bytes from `addr` to the end of its map, or 0 if it is unmapped
+paddr_t mmio_map_span(paddr_t addr);
+// copy `len` bytes from the space of the map at `addr` without calling its
+// callback, the range must be inside the map
+void mmio_peek(paddr_t addr, void *buf, size_t len);
+
+// Passive MMIO regions are plain memory, which is accessed directly like
+// pmem, without locking, callbacks or bookkeeping. A device may still ask
+// for the written parts to be marked in a dirty map, with one byte for each
+// MMIO_DIRTY_GRAIN bytes, which the device clears after handling them.
+#define MMIO_DIRTY_SHIFT 10
+#define MMIO_DIRTY_GRAIN (1 << MMIO_DIRTY_SHIFT)
+
+typedef struct {
+  paddr_t low;
+  paddr_t size;
+  uint8_t *space;
+  uint8_t *dirty;
+} MMIOMem;
+
+#define NR_MMIO_MEM 4
+extern MMIOMem mmio_mem[NR_MMIO_MEM];
+extern int nr_mmio_mem;
+
+// return the passive region holding [addr, addr + len), or NULL if there is none
+static inline MMIOMem* mmio_mem_find(paddr_t addr, int len) {
+  int i;
+  for (i = 0; i < nr_mmio_mem; i ++) {
+    if (addr - mmio_mem[i].low <= mmio_mem[i].size - len) return &mmio_mem[i];
+  }
+  return NULL;
+}
+
+// return the host address of [addr, addr + len) if it is in a passive region
+static inline uint8_t* mmio_mem_host(paddr_t addr, int len) {
+  MMIOMem *m = mmio_mem_find(addr, len);
+  return (m != NULL ? m->space + (addr - m->low) : NULL);
+}
+
+// mark [addr, addr + len) in the passive region `m` as written
+static inline void mmio_mem_dirty(MMIOMem *m, paddr_t addr, size_t len) {
+  if (m->dirty == NULL || len == 0) return;
+  paddr_t first = (addr - m->low) >> MMIO_DIRTY_SHIFT;
+  paddr_t last = (addr - m->low + len - 1) >> MMIO_DIRTY_SHIFT;
+  m->dirty[first] = 1;
+  for (; first < last; first ++) m->dirty[first + 1] = 1;
+}
+
+// devices are not thread-safe, so harts in different threads access them in turn,
+// there is nothing to lock without the devices
+#if defined(CONFIG_HART_THREAD) && defined(CONFIG_DEVICE)
+void device_lock();
+void device_unlock();
+#else
+static inline void device_lock() {}
+static inline void device_unlock() {}
+#endif
 
 #endif
@@ -29,7 +29,11 @@ extern unsigned char isa_logo[];
 void init_isa();
 
 // reg
-extern CPU_state cpu;
+extern HART_LOCAL CPU_state cpu;
+#if NR_HART > 1
+// the state of the harts which are not running in the current thread
+extern CPU_state hart[NR_HART];
+#endif
 void isa_reg_display();
 word_t isa_reg_str2val(const char *name, bool *success);
 
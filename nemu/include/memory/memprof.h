@@ -0,0 +1,56 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+
+#ifndef __MEMORY_MEMPROF_H__
+#define __MEMORY_MEMPROF_H__
+
+#include <common.h>
+
+#ifdef CONFIG_MEMPROF
+#include <memory/paddr.h>
+#include <memory/vaddr.h>
+
+// Count the guest accesses to each page of pmem by MEM_TYPE_*, and to each
+// cache line. The pages touched in every interval of instructions are also
+// recorded as the working set. See memprof.c for the profile written at exit.
+#define MEMPROF_LINE_SHIFT 6
+#define MEMPROF_NR_PAGE (CONFIG_MSIZE >> PAGE_SHIFT)
+#define MEMPROF_NR_LINE (CONFIG_MSIZE >> MEMPROF_LINE_SHIFT)
+
+extern uint64_t memprof_page[3][MEMPROF_NR_PAGE];
+extern uint32_t memprof_line[MEMPROF_NR_LINE];
+extern uint64_t memprof_ws[(MEMPROF_NR_PAGE + 63) / 64];
+extern uint64_t memprof_ws_end;
+extern HART_LOCAL uint64_t g_nr_guest_inst;
+
+void memprof_ws_close();
+void memprof_statistic();
+
+static inline void memprof_access(int type, paddr_t addr) {
+  if (unlikely(g_nr_guest_inst >= memprof_ws_end)) memprof_ws_close();
+  if (!in_pmem(addr)) return;
+  paddr_t offset = addr - CONFIG_MBASE;
+  uint32_t page = offset >> PAGE_SHIFT;
+  memprof_page[type][page] ++;
+  uint32_t *line = &memprof_line[offset >> MEMPROF_LINE_SHIFT];
+  if (*line != UINT32_MAX) (*line) ++;
+  memprof_ws[page / 64] |= 1ull << (page % 64);
+}
+#else
+static inline void memprof_access(int type, paddr_t addr) {}
+#endif
+
+#endif
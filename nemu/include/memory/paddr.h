@@ -31,7 +31,32 @@ static inline bool in_pmem(paddr_t addr) {
   return addr - CONFIG_MBASE < CONFIG_MSIZE;
 }
 
+// Make [addr, addr + len) in pmem accessible to system calls such as read().
+void pmem_prefault(paddr_t addr, size_t len);
+
+// used by snapshots and the ELF loader, see paddr.c
+bool pmem_page_is_zero(paddr_t addr);
+void pmem_reset();
+bool pmem_load_file(paddr_t addr, size_t len, int fd, off_t offset);
+bool pmem_zero(paddr_t addr, size_t len);
+
 word_t paddr_read(paddr_t addr, int len);
 void paddr_write(paddr_t addr, int len, word_t data);
 
+// Copy between `buf` and [addr, addr + len). Spans of pmem, memory regions
+// and passive MMIO are copied with memcpy(), and the other MMIO maps are
+// accessed through their callbacks with the widest aligned accesses. Return
+// false without accessing anything if part of the range is unmapped, or is
+// in ROM for a write.
+bool paddr_read_block(paddr_t addr, void *buf, size_t len);
+bool paddr_write_block(paddr_t addr, const void *buf, size_t len);
+// Like paddr_read_block(), but MMIO maps are read from their space without
+// calling the callbacks, so the devices are not disturbed. For the debugger.
+bool paddr_peek_block(paddr_t addr, void *buf, size_t len);
+
+// Atomic accesses to an aligned word in pmem, which are also atomic with
+// respect to harts running in other host threads.
+word_t paddr_amo(paddr_t addr, word_t (*op)(word_t old, word_t src), word_t src);
+bool paddr_cmpxchg(paddr_t addr, word_t old, word_t data);
+
 #endif
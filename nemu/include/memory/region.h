@@ -0,0 +1,62 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+
+#ifndef __MEMORY_REGION_H__
+#define __MEMORY_REGION_H__
+
+#include <common.h>
+#include <memory/vaddr.h>
+
+// RAM and ROM regions outside pmem, such as flash, SRAM and PSRAM in an SoC.
+// They are host memory like pmem, so accesses to them do not go through the
+// MMIO callbacks.
+typedef struct {
+  const char *name;
+  const char *file; // initial content, or NULL for zero
+  paddr_t low;
+  paddr_t size;
+  bool readonly;
+  uint8_t *space;
+} MemRegion;
+
+#define NR_MEM_REGION 8
+extern MemRegion mem_region[NR_MEM_REGION];
+extern int nr_mem_region;
+
+// The regions are found by a two-level table indexed by the 32-bit address,
+// whose leaves hold the region ID + 1 of each page.
+#define MEM_REGION_DIR_SHIFT 22
+typedef uint8_t MemRegionLeaf[1 << (MEM_REGION_DIR_SHIFT - PAGE_SHIFT)];
+extern MemRegionLeaf *mem_region_dir[1 << (32 - MEM_REGION_DIR_SHIFT)];
+
+// return the region holding [addr, addr + len), or NULL if there is none
+static inline MemRegion* mem_region_find(paddr_t addr, int len) {
+  if ((uint64_t)addr >> 32) return NULL;
+  MemRegionLeaf *leaf = mem_region_dir[(uint32_t)addr >> MEM_REGION_DIR_SHIFT];
+  if (leaf == NULL) return NULL;
+  uint8_t id = (*leaf)[(addr >> PAGE_SHIFT) % ARRLEN(*leaf)];
+  if (id == 0) return NULL;
+  MemRegion *r = &mem_region[id - 1];
+  return (addr - r->low <= r->size - len ? r : NULL);
+}
+
+// record a region, which is mapped by init_mem()
+void add_mem_region(const char *name, paddr_t addr, paddr_t size,
+    bool readonly, const char *file);
+void init_mem_region();
+void mem_region_display();
+
+#endif
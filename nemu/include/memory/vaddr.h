@@ -21,6 +21,12 @@
 word_t vaddr_ifetch(vaddr_t addr, int len);
 word_t vaddr_read(vaddr_t addr, int len);
 void vaddr_write(vaddr_t addr, int len, word_t data);
+word_t vaddr_amo(vaddr_t addr, word_t (*op)(word_t old, word_t src), word_t src);
+bool vaddr_cmpxchg(vaddr_t addr, word_t old, word_t data);
+
+// drop all entries of the software TLB of the current hart, which should be
+// called when the mapping from virtual pages to pmem changes
+void tlb_flush();
 
 #define PAGE_SHIFT        12
 #define PAGE_SIZE         (1ul << PAGE_SHIFT)
@@ -33,6 +33,8 @@ extern NEMUState nemu_state;
 // ----------- timer -----------
 
 uint64_t get_time();
+void set_time(uint64_t us);
+uint64_t get_guest_time();
 
 // ----------- log -----------
 
@@ -73,5 +75,43 @@ uint64_t get_time();
     log_write(__VA_ARGS__); \
   } while (0)
 
+// ----------- itrace -----------
+
+#ifdef CONFIG_ITRACE
+typedef struct {
+  vaddr_t pc;
+  uint32_t inst;
+  uint32_t ilen;
+} IRingBufEntry;
+
+extern IRingBufEntry iringbuf[CONFIG_IRINGBUF_SIZE];
+extern uint64_t iringbuf_nr;
+
+static inline void iringbuf_push(vaddr_t pc, uint32_t inst, uint32_t ilen) {
+  IRingBufEntry *e = &iringbuf[iringbuf_nr ++ % CONFIG_IRINGBUF_SIZE];
+  e->pc = pc;
+  e->inst = inst;
+  e->ilen = ilen;
+}
+
+void iringbuf_display();
+void itrace_disasm(char *buf, int size, vaddr_t pc, uint32_t inst, int ilen);
+#endif
+
+// ----------- symbol -----------
+
+// Find the function or object in the ELF image containing `addr`, and the
+// offset of `addr` in it. Return NULL if there is none.
+const char *symbol_lookup(word_t addr, word_t *offset);
+
+// ----------- snapshot -----------
+
+// Save `size` bytes at `p` into snapshots as the section `name`. If `sync`
+// is not NULL, it is called with false before saving and with true after
+// restoring the section.
+void snapshot_add(const char *name, void *p, size_t size, void (*sync)(bool restore));
+bool snapshot_save(const char *path);
+bool snapshot_load(const char *path);
+
 
 #endif
@@ -14,9 +14,17 @@
  ***************************************************************************************/
 
 #include <cpu/cpu.h>
+#include <cpu/dcache.h>
 #include <cpu/decode.h>
 #include <cpu/difftest.h>
+#include <cpu/jit.h>
+#include <cpu/tblock.h>
+#include <memory/memprof.h>
+#include <memory/vaddr.h>
 #include <locale.h>
+#ifdef CONFIG_HART_THREAD
+#include <pthread.h>
+#endif
 
 /* The assembly code of instructions executed is only output to the screen
  * when the number of instructions executed is less than this value.
@@ -25,24 +33,80 @@
  */
 #define MAX_INST_TO_PRINT 10
 
-CPU_state cpu = {};
-uint64_t g_nr_guest_inst = 0;
+HART_LOCAL CPU_state cpu = {};
+HART_LOCAL uint64_t g_nr_guest_inst = 0;
 static uint64_t g_timer = 0; // unit: us
 static bool g_print_step = false;
 
 void device_update();
+void io_display();
+void serial_flush();
+extern HART_LOCAL uint64_t g_device_deadline;
 bool if_expr_change();
+bool wp_exist();
+
+#ifdef CONFIG_ITRACE
+static bool g_itrace_on = true;
+#endif
+
+void cpu_set_itrace(bool on) { IFDEF(CONFIG_ITRACE, g_itrace_on = on); }
 
+// The instrumented loop is only used when a debugging feature is active.
+// They are only changed from sdb, so it is enough to choose the loop at the
+// beginning of cpu_exec().
+static bool is_instrumented() {
+    return MUXDEF(CONFIG_ITRACE, g_itrace_on, false) ||
+           difftest_is_attached() || wp_exist();
+}
+
+#if defined(CONFIG_ENGINE_THREADED) || defined(CONFIG_ENGINE_JIT)
+static void execute(uint64_t n) {
+    // run one instruction at a time to check difftest and watchpoints
+    bool step = is_instrumented();
+    while (n > 0) {
+        vaddr_t pc = cpu.pc;
+        uint64_t budget = (step ? 1 : n);
+#ifdef CONFIG_DEVICE
+        if (g_device_deadline > g_nr_guest_inst &&
+            g_device_deadline - g_nr_guest_inst < budget) {
+            budget = g_device_deadline - g_nr_guest_inst;
+        }
+#endif
+        uint64_t nr = MUXDEF(CONFIG_ENGINE_JIT, jit_exec, tblock_exec)(budget);
+        g_nr_guest_inst += nr;
+        n -= nr;
+        if (step) {
+            difftest_step(pc, cpu.pc);
+            if (if_expr_change()) {
+                nemu_state.state = NEMU_STOP;
+            }
+        }
+        if (nemu_state.state != NEMU_RUNNING)
+            break;
+        IFDEF(CONFIG_DEVICE, if (g_nr_guest_inst >= g_device_deadline) device_update());
+    }
+}
+#else
 static void trace_and_difftest(Decode *_this, vaddr_t dnpc) {
-#ifdef CONFIG_ITRACE_COND
-    if (ITRACE_COND) {
-        log_write("%s\n", _this->logbuf);
+#ifdef CONFIG_ITRACE
+    if (g_itrace_on) {
+        int ilen = _this->snpc - _this->pc;
+        iringbuf_push(_this->pc, _this->isa.inst.val, ilen);
+        bool log = MUXDEF(CONFIG_ITRACE_LOG, ITRACE_COND, false);
+        if (log || g_print_step) {
+            char buf[128];
+            itrace_disasm(buf, sizeof(buf), _this->pc, _this->isa.inst.val,
+                          ilen);
+            if (log) {
+                log_write("%s\n", buf);
+            }
+            if (g_print_step) {
+                puts(buf);
+            }
+        }
     }
 #endif
-    if (g_print_step) {
-        IFDEF(CONFIG_ITRACE, puts(_this->logbuf));
-    }
-    IFDEF(CONFIG_DIFFTEST, difftest_step(_this->pc, dnpc));
+    difftest_step(_this->pc, dnpc);
 
     if (if_expr_change()) {
         nemu_state.state = NEMU_STOP;
@@ -54,36 +118,9 @@ static void exec_once(Decode *s, vaddr_t pc) {
     s->snpc = pc;
     isa_exec_once(s);
     cpu.pc = s->dnpc;
-#ifdef CONFIG_ITRACE
-    char *p = s->logbuf;
-    p += snprintf(p, sizeof(s->logbuf), FMT_WORD ":", s->pc);
-    int ilen = s->snpc - s->pc;
-    int i;
-    uint8_t *inst = (uint8_t *)&s->isa.inst.val;
-    for (i = ilen - 1; i >= 0; i--) {
-        p += snprintf(p, 4, " %02x", inst[i]);
-    }
-    int ilen_max = MUXDEF(CONFIG_ISA_x86, 8, 4);
-    int space_len = ilen_max - ilen;
-    if (space_len < 0)
-        space_len = 0;
-    space_len = space_len * 3 + 1;
-    memset(p, ' ', space_len);
-    p += space_len;
-
-#ifndef CONFIG_ISA_loongarch32r
-    void disassemble(char *str, int size, uint64_t pc, uint8_t *code,
-                     int nbyte);
-    disassemble(p, s->logbuf + sizeof(s->logbuf) - p,
-                MUXDEF(CONFIG_ISA_x86, s->snpc, s->pc),
-                (uint8_t *)&s->isa.inst.val, ilen);
-#else
-    p[0] = '\0'; // the upstream llvm does not support loongarch32r
-#endif
-#endif
 }
 
-static void execute(uint64_t n) {
+static void execute_instrumented(uint64_t n) {
     Decode s;
     for (; n > 0; n--) {
         exec_once(&s, cpu.pc);
@@ -91,24 +128,163 @@ static void execute(uint64_t n) {
         trace_and_difftest(&s, cpu.pc);
         if (nemu_state.state != NEMU_RUNNING)
             break;
-        IFDEF(CONFIG_DEVICE, device_update());
+        IFDEF(CONFIG_DEVICE, if (g_nr_guest_inst >= g_device_deadline) device_update());
+    }
+}
+
+static void execute_bare(uint64_t n) {
+    Decode s;
+    for (; n > 0; n--) {
+        exec_once(&s, cpu.pc);
+        g_nr_guest_inst++;
+        // still kept for the report when the guest aborts
+        IFDEF(CONFIG_ITRACE, iringbuf_push(s.pc, s.isa.inst.val, s.snpc - s.pc));
+        if (nemu_state.state != NEMU_RUNNING)
+            break;
+        IFDEF(CONFIG_DEVICE, if (g_nr_guest_inst >= g_device_deadline) device_update());
+    }
+}
+
+static void execute(uint64_t n) {
+    if (is_instrumented()) {
+        execute_instrumented(n);
+    } else {
+        execute_bare(n);
+    }
+}
+
+#if NR_HART > 1
+CPU_state hart[NR_HART] = {};
+
+#ifdef CONFIG_HART_THREAD
+// the harts other than hart 0 save their counters here when they stop
+static uint64_t hart_nr_inst[NR_HART] = {};
+static uint64_t hart_budget = 0;
+
+static void *hart_thread(void *arg) {
+    int id = (intptr_t)arg;
+    // the events of the devices are handled by hart 0
+    IFDEF(CONFIG_DEVICE, g_device_deadline = UINT64_MAX);
+    tlb_flush();
+
+    cpu = hart[id];
+    g_nr_guest_inst = hart_nr_inst[id];
+    execute_bare(hart_budget);
+    hart[id] = cpu;
+    hart_nr_inst[id] = g_nr_guest_inst;
+    return NULL;
+}
+
+// Hart 0 runs in the calling thread, so the devices and the debugging
+// features keep working for it. The other harts run without them.
+static void execute_harts(uint64_t n) {
+    pthread_t tid[NR_HART];
+    int i;
+    hart_budget = n;
+    for (i = 1; i < NR_HART; i++) {
+        int ret =
+            pthread_create(&tid[i], NULL, hart_thread, (void *)(intptr_t)i);
+        Assert(ret == 0, "Can not create the thread of hart %d", i);
+    }
+    execute(n);
+    for (i = 1; i < NR_HART; i++) {
+        pthread_join(tid[i], NULL);
+    }
+}
+
+static uint64_t nr_inst_total() {
+    uint64_t nr = g_nr_guest_inst;
+    int i;
+    for (i = 1; i < NR_HART; i++) {
+        nr += hart_nr_inst[i];
+    }
+    return nr;
+}
+#else
+// The harts take turns to run a quantum of instructions in the calling
+// thread, so the interleaving only depends on the executed instructions.
+// `cpu` is the state of the current hart.
+static int g_hart_id = 0;
+static uint64_t g_quantum_left = CONFIG_HART_QUANTUM;
+
+static void execute_harts(uint64_t n) {
+    while (n > 0) {
+        uint64_t budget = (n < g_quantum_left ? n : g_quantum_left);
+        uint64_t start = g_nr_guest_inst;
+        execute(budget);
+        uint64_t nr = g_nr_guest_inst - start;
+        n -= nr;
+        g_quantum_left -= nr;
+        if (g_quantum_left == 0) {
+            hart[g_hart_id] = cpu;
+            g_hart_id = (g_hart_id + 1) % NR_HART;
+            cpu = hart[g_hart_id];
+            // the harts may map their pages differently
+            tlb_flush();
+            g_quantum_left = CONFIG_HART_QUANTUM;
+        }
+        if (nemu_state.state != NEMU_RUNNING)
+            break;
     }
 }
+#endif
+#endif
+#endif
+
+#ifndef CONFIG_HART_THREAD
+static uint64_t nr_inst_total() { return g_nr_guest_inst; }
+#endif
+
+#if NR_HART > 1
+// `cpu` holds the state of the current hart, which is hart 0 in the
+// threaded mode
+static void sync_hart(bool restore) {
+    int id = MUXDEF(CONFIG_HART_THREAD, 0, g_hart_id);
+    if (restore)
+        cpu = hart[id];
+    else
+        hart[id] = cpu;
+}
+#endif
+
+void init_cpu_snapshot() {
+    snapshot_add("nr_inst", &g_nr_guest_inst, sizeof(g_nr_guest_inst), NULL);
+#if NR_HART == 1
+    snapshot_add("cpu", &cpu, sizeof(cpu), NULL);
+#else
+#ifdef CONFIG_HART_THREAD
+    snapshot_add("hart_nr_inst", hart_nr_inst, sizeof(hart_nr_inst), NULL);
+#else
+    snapshot_add("hart_id", &g_hart_id, sizeof(g_hart_id), NULL);
+    snapshot_add("quantum_left", &g_quantum_left, sizeof(g_quantum_left),
+                 NULL);
+#endif
+    snapshot_add("cpu", hart, sizeof(hart), sync_hart);
+#endif
+}
 
 static void statistic() {
     IFNDEF(CONFIG_TARGET_AM, setlocale(LC_NUMERIC, ""));
 #define NUMBERIC_FMT MUXDEF(CONFIG_TARGET_AM, "%", "%'") PRIu64
+    uint64_t nr_inst = nr_inst_total();
     Log("host time spent = " NUMBERIC_FMT " us", g_timer);
-    Log("total guest instructions = " NUMBERIC_FMT, g_nr_guest_inst);
+    Log("total guest instructions = " NUMBERIC_FMT, nr_inst);
+    IFDEF(CONFIG_ICOUNT,
+          Log("guest time elapsed = " NUMBERIC_FMT " us", get_guest_time()));
     if (g_timer > 0)
         Log("simulation frequency = " NUMBERIC_FMT " inst/s",
-            g_nr_guest_inst * 1000000 / g_timer);
+            nr_inst * 1000000 / g_timer);
     else
         Log("Finish running in less than 1 us and can not calculate the "
             "simulation frequency");
+    IFDEF(CONFIG_DCACHE, dcache_statistic());
+    IFDEF(CONFIG_MEMPROF, memprof_statistic());
+    IFDEF(CONFIG_ENGINE_JIT, jit_statistic());
+    IFDEF(CONFIG_DEVICE, io_display());
 }
 
 void assert_fail_msg() {
+    IFDEF(CONFIG_ITRACE, iringbuf_display());
     isa_reg_display();
     statistic();
 }
@@ -128,10 +304,16 @@ void cpu_exec(uint64_t n) {
 
     uint64_t timer_start = get_time();
 
+#if NR_HART > 1
+    execute_harts(n);
+#else
     execute(n);
+#endif
 
     uint64_t timer_end = get_time();
     g_timer += timer_end - timer_start;
+    // the output of the guest comes before the messages below
+    IFDEF(CONFIG_SERIAL_BUFFERED, serial_flush());
 
     switch (nemu_state.state) {
     case NEMU_RUNNING:
@@ -147,6 +329,9 @@ void cpu_exec(uint64_t n) {
                         ? ANSI_FMT("HIT GOOD TRAP", ANSI_FG_GREEN)
                         : ANSI_FMT("HIT BAD TRAP", ANSI_FG_RED))),
             nemu_state.halt_pc);
+        if (nemu_state.state == NEMU_ABORT || nemu_state.halt_ret != 0) {
+            IFDEF(CONFIG_ITRACE, iringbuf_display());
+        }
         // fall through
     case NEMU_QUIT:
         statistic();
@@ -0,0 +1,45 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <cpu/dcache.h>
+#include <memory/paddr.h>
+
+#ifdef CONFIG_DCACHE
+
+HART_LOCAL DecodeCacheEntry dcache[DCACHE_SIZE] = {};
+HART_LOCAL uint64_t dcache_nr_hit = 0;
+
+void dcache_fill(vaddr_t pc, uint32_t inst, const void *handler,
+    int rd, int rs1, int rs2, word_t imm) {
+  // we can not observe writes to instructions outside pmem
+  if (!in_pmem(pc)) return;
+  dcache[(pc >> 2) & (DCACHE_SIZE - 1)] = (DecodeCacheEntry) {
+    .pc = pc, .inst = inst, .handler = handler,
+    .rd = rd, .rs1 = rs1, .rs2 = rs2, .imm = imm };
+}
+
+void dcache_flush() {
+  memset(dcache, 0, sizeof(dcache));
+}
+
+void dcache_statistic() {
+  extern HART_LOCAL uint64_t g_nr_guest_inst;
+  if (g_nr_guest_inst == 0) return;
+  uint64_t permyriad = dcache_nr_hit * 10000 / g_nr_guest_inst;
+  Log("decode cache hit rate = %d.%02d%% (%" PRIu64 " hits)",
+      (int)(permyriad / 100), (int)(permyriad % 100), dcache_nr_hit);
+}
+
+#endif
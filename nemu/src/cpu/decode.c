@@ -0,0 +1,149 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <cpu/decode.h>
+
+#ifdef CONFIG_DECODE_TREE
+
+#ifdef CONFIG_HART_THREAD
+#include <pthread.h>
+
+static pthread_mutex_t tree_mutex = PTHREAD_MUTEX_INITIALIZER;
+void instpat_tree_lock() { pthread_mutex_lock(&tree_mutex); }
+void instpat_tree_unlock() { pthread_mutex_unlock(&tree_mutex); }
+#else
+void instpat_tree_lock() {}
+void instpat_tree_unlock() {}
+#endif
+
+void instpat_tree_add(InstPatTree *t, uint64_t key, uint64_t mask, uint64_t shift, const void *body) {
+  Assert(t->nr_pat < INSTPAT_MAX, "too many patterns, please enlarge INSTPAT_MAX");
+  t->pat[t->nr_pat ++] = (InstPat) { .key = key, .mask = mask, .shift = shift, .body = body };
+}
+
+static void bucket_fields(uint64_t bmask, int *lo0, int *w0, int *lo1, int *w1) {
+  *lo0 = __builtin_ctzll(bmask);
+  *w0 = __builtin_ctzll(~(bmask >> *lo0));
+  uint64_t rest = (bmask >> *lo0) >> *w0;
+  *lo1 = *w1 = 0;
+  if (rest != 0) {
+    *lo1 = __builtin_ctzll(rest) + *lo0 + *w0;
+    *w1 = __builtin_ctzll(~(bmask >> *lo1));
+  }
+  Assert(__builtin_popcountll(bmask) == *w0 + *w1,
+      "INSTPAT_BUCKET_MASK = 0x%" PRIx64 " should consist of at most two fields", bmask);
+  Assert(*w0 + *w1 <= INSTPAT_BUCKET_MAX_BITS,
+      "INSTPAT_BUCKET_MASK = 0x%" PRIx64 " selects too many bits", bmask);
+}
+
+// the instruction bits selected by the bucket mask for bucket `b`
+static uint64_t bucket_bits(uint32_t b, int lo0, int w0, int lo1) {
+  return ((uint64_t)(b & BITMASK(w0)) << lo0) | ((uint64_t)(b >> w0) << lo1);
+}
+
+static bool pat_match(const InstPat *p, uint64_t inst) {
+  return ((inst >> p->shift) & p->mask) == p->key;
+}
+
+#ifdef CONFIG_RT_CHECK
+static int linear_scan(InstPatTree *t, uint64_t inst) {
+  int i;
+  for (i = 0; i < t->nr_pat; i ++) {
+    if (pat_match(&t->pat[i], inst)) return i;
+  }
+  return -1;
+}
+
+static int tree_scan(InstPatTree *t, uint64_t inst, uint64_t bmask) {
+  const void *body = instpat_tree_lookup(t, inst, bmask);
+  int i;
+  for (i = 0; i < t->nr_pat; i ++) {
+    if (t->pat[i].body == body) return i;
+  }
+  return -1;
+}
+
+static uint64_t rand64() {
+  return ((uint64_t)rand() << 62) ^ ((uint64_t)rand() << 31) ^ rand();
+}
+
+// Check that the tree picks the same pattern as the linear scan, for an
+// instruction matching each pattern in each bucket, as well as random ones.
+static void tree_check(InstPatTree *t, uint64_t bmask, int lo0, int w0, int lo1, int w1) {
+  uint32_t b;
+  int i, k;
+  for (b = 0; b < (1u << (w0 + w1)); b ++) {
+    for (i = 0; i < t->nr_pat; i ++) {
+      InstPat *p = &t->pat[i];
+      uint64_t m = p->mask << p->shift;
+      for (k = 0; k < 2; k ++) {
+        uint64_t inst = (rand64() & ~bmask) | bucket_bits(b, lo0, w0, lo1);
+        inst = (inst & ~m) | (p->key << p->shift);
+        int expect = linear_scan(t, inst);
+        int actual = tree_scan(t, inst, bmask);
+        Assert(expect == actual, "decode tree mismatch for inst = 0x%" PRIx64
+            ": linear scan matches pattern %d, but the tree matches pattern %d", inst, expect, actual);
+      }
+    }
+  }
+  for (k = 0; k < 4096; k ++) {
+    uint64_t inst = rand64();
+    Assert(linear_scan(t, inst) == tree_scan(t, inst, bmask),
+        "decode tree mismatch for inst = 0x%" PRIx64, inst);
+  }
+}
+#endif
+
+void instpat_tree_build(InstPatTree *t, uint64_t bmask) {
+  int lo0, w0, lo1, w1;
+  bucket_fields(bmask, &lo0, &w0, &lo1, &w1);
+
+  int nr_chain = 0;
+  int16_t list[INSTPAT_MAX + 1];
+  uint32_t b;
+  for (b = 0; b < (1u << (w0 + w1)); b ++) {
+    // collect the patterns which may match some instruction in this bucket
+    uint64_t bits = bucket_bits(b, lo0, w0, lo1);
+    int n = 0, i;
+    for (i = 0; i < t->nr_pat; i ++) {
+      InstPat *p = &t->pat[i];
+      if ((((p->key << p->shift) ^ bits) & (p->mask << p->shift) & bmask) == 0) {
+        list[n ++] = i;
+        // this pattern matches the whole bucket, so the patterns after it
+        // will never be chosen
+        if (((p->mask << p->shift) & ~bmask) == 0) break;
+      }
+    }
+    list[n ++] = -1;
+
+    // share the chain with other buckets if possible
+    int start;
+    for (start = 0; start + n <= nr_chain; start ++) {
+      if (memcmp(&t->chain[start], list, sizeof(list[0]) * n) == 0) break;
+    }
+    if (start + n > nr_chain) {
+      Assert(nr_chain + n <= INSTPAT_CHAIN_MAX, "too many chains, please enlarge INSTPAT_CHAIN_MAX");
+      memcpy(&t->chain[nr_chain], list, sizeof(list[0]) * n);
+      start = nr_chain;
+      nr_chain += n;
+    }
+    t->bucket[b] = start;
+  }
+
+  IFDEF(CONFIG_RT_CHECK, tree_check(t, bmask, lo0, w0, lo1, w1));
+  __atomic_store_n(&t->state, INSTPAT_TREE_READY, __ATOMIC_RELEASE);
+}
+
+#endif
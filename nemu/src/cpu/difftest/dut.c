@@ -30,6 +30,7 @@ void (*ref_difftest_raise_intr)(uint64_t NO) = NULL;
 
 static bool is_skip_ref = false;
 static int skip_dut_nr_inst = 0;
+static bool is_detach_mode = false;
 
 // this is used to let ref skip instructions which
 // can not produce consistent behavior with NEMU
@@ -52,6 +53,7 @@ void difftest_skip_ref() {
 //   Let REF run `nr_ref` instructions first.
 //   We expect that DUT will catch up with REF within `nr_dut` instructions.
 void difftest_skip_dut(int nr_ref, int nr_dut) {
+  if (is_detach_mode) return;
   skip_dut_nr_inst += nr_dut;
 
   while (nr_ref -- > 0) {
@@ -102,6 +104,8 @@ static void checkregs(CPU_state *ref, vaddr_t pc) {
 void difftest_step(vaddr_t pc, vaddr_t npc) {
   CPU_state ref_r;
 
+  if (is_detach_mode) return;
+
   if (skip_dut_nr_inst > 0) {
     ref_difftest_regcpy(&ref_r, DIFFTEST_TO_DUT);
     if (ref_r.pc == npc) {
@@ -127,6 +131,24 @@ void difftest_step(vaddr_t pc, vaddr_t npc) {
 
   checkregs(&ref_r, pc);
 }
+
+void difftest_detach() {
+  is_detach_mode = true;
+}
+
+// the REF may be far behind, so copy the whole state of DUT to it
+void difftest_attach() {
+  is_detach_mode = false;
+  is_skip_ref = false;
+  skip_dut_nr_inst = 0;
+  ref_difftest_memcpy(CONFIG_MBASE, guest_to_host(CONFIG_MBASE), CONFIG_MSIZE, DIFFTEST_TO_REF);
+  isa_difftest_attach();
+  ref_difftest_regcpy(&cpu, DIFFTEST_TO_REF);
+}
+
+bool difftest_is_attached() {
+  return !is_detach_mode;
+}
 #else
 void init_difftest(char *ref_so_file, long img_size, int port) { }
 #endif
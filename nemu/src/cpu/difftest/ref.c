@@ -19,7 +19,10 @@
 #include <memory/paddr.h>
 
 __EXPORT void difftest_memcpy(paddr_t addr, void *buf, size_t n, bool direction) {
-  assert(0);
+  bool ok = (direction == DIFFTEST_TO_REF ? paddr_write_block(addr, buf, n)
+      : paddr_read_block(addr, buf, n));
+  Assert(ok, "can not copy [" FMT_PADDR ", " FMT_PADDR "] of the REF",
+      addr, (paddr_t)(addr + n - 1));
 }
 
 __EXPORT void difftest_regcpy(void *dut, bool direction) {
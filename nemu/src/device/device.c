@@ -15,10 +15,15 @@
 
 #include <common.h>
 #include <utils.h>
-#include <device/alarm.h>
+#include <device/event.h>
+#include <device/map.h>
+#include <device/mmio.h>
 #ifndef CONFIG_TARGET_AM
 #include <SDL2/SDL.h>
 #endif
+#ifdef CONFIG_HART_THREAD
+#include <pthread.h>
+#endif
 
 void init_map();
 void init_serial();
@@ -28,19 +33,19 @@ void init_i8042();
 void init_audio();
 void init_disk();
 void init_sdcard();
-void init_alarm();
 
 void send_key(uint8_t, bool);
 void vga_update_screen();
 
-void device_update() {
-  static uint64_t last = 0;
-  uint64_t now = get_time();
-  if (now - last < 1000000 / TIMER_HZ) {
-    return;
-  }
-  last = now;
+#ifdef CONFIG_HART_THREAD
+static pthread_mutex_t device_mutex = PTHREAD_MUTEX_INITIALIZER;
+void device_lock() { pthread_mutex_lock(&device_mutex); }
+void device_unlock() { pthread_mutex_unlock(&device_mutex); }
+#endif
+
+static Event refresh_event;
 
+static void device_refresh(void *arg) {
   IFDEF(CONFIG_HAS_VGA, vga_update_screen());
 
 #ifndef CONFIG_TARGET_AM
@@ -66,6 +71,25 @@ void device_update() {
 #endif
 }
 
+// called by the CPU when `g_nr_guest_inst` reaches `g_device_deadline`
+void device_update() {
+  device_lock();
+  event_run();
+  device_unlock();
+}
+
+void mmio_display();
+void pio_display();
+void vga_statistic();
+
+// print the number of accesses to each device
+void io_display() {
+  mmio_display();
+  IFDEF(CONFIG_HAS_PORT_IO, pio_display());
+  IFDEF(CONFIG_HAS_VGA, vga_statistic());
+  event_display();
+}
+
 void sdl_clear_event_queue() {
 #ifndef CONFIG_TARGET_AM
   SDL_Event event;
@@ -84,6 +108,10 @@ void init_device() {
   IFDEF(CONFIG_HAS_AUDIO, init_audio());
   IFDEF(CONFIG_HAS_DISK, init_disk());
   IFDEF(CONFIG_HAS_SDCARD, init_sdcard());
+  map_snapshot_add();
 
-  IFNDEF(CONFIG_TARGET_AM, init_alarm());
+  event_init(&refresh_event, "refresh", EVENT_GUEST, device_refresh, NULL);
+  event_schedule(&refresh_event, event_now(EVENT_GUEST) + EVENT_GUEST_PERIOD(TIMER_HZ),
+      EVENT_GUEST_PERIOD(TIMER_HZ));
+  event_snapshot_add();
 }
@@ -0,0 +1,206 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+
+#include <device/event.h>
+#include <utils.h>
+
+// Each clock has a binary min-heap of the pending events ordered by `when`.
+// The CPU only compares its instruction counter against a single deadline,
+// `g_device_deadline`, which is the next EVENT_INST event, or the next time
+// to sample the host clock if some EVENT_HOST event is pending.
+#define MAX_EVENT 16
+
+// The host clock is sampled when the instruction budget returned by
+// next_budget() runs out. The budget follows the measured speed of the
+// guest, so that it runs out about every SAMPLE_US, i.e. 4 times in
+// 1/TIMER_HZ second.
+#define SAMPLE_US (1000000 / TIMER_HZ / 4)
+#define BUDGET_MIN 256
+#define BUDGET_MAX (1 << 24)
+
+#ifdef CONFIG_ICOUNT
+static_assert(EVENT_GUEST_PERIOD(TIMER_HZ) > 0, "CONFIG_ICOUNT_FREQ is too small");
+#endif
+
+HART_LOCAL uint64_t g_device_deadline = 0;
+extern HART_LOCAL uint64_t g_nr_guest_inst;
+
+static Event *events[MAX_EVENT] = {};
+static int nr_event = 0;
+static Event *queue[NR_EVENT_CLOCK][MAX_EVENT] = {};
+static int nr_queue[NR_EVENT_CLOCK] = {};
+
+static void queue_set(Event **q, int i, Event *e) {
+  q[i] = e;
+  e->pos = i;
+}
+
+static void sift_up(Event **q, int i) {
+  Event *e = q[i];
+  while (i > 0 && q[(i - 1) / 2]->when > e->when) {
+    queue_set(q, i, q[(i - 1) / 2]);
+    i = (i - 1) / 2;
+  }
+  queue_set(q, i, e);
+}
+
+static void sift_down(Event **q, int n, int i) {
+  Event *e = q[i];
+  while (2 * i + 1 < n) {
+    int c = 2 * i + 1;
+    if (c + 1 < n && q[c + 1]->when < q[c]->when) c ++;
+    if (q[c]->when >= e->when) break;
+    queue_set(q, i, q[c]);
+    i = c;
+  }
+  queue_set(q, i, e);
+}
+
+static void queue_insert(Event *e) {
+  int n = nr_queue[e->clock] ++;
+  queue[e->clock][n] = e;
+  sift_up(queue[e->clock], n);
+}
+
+static void queue_remove(Event *e) {
+  Event **q = queue[e->clock];
+  int i = e->pos;
+  int n = -- nr_queue[e->clock];
+  e->pos = -1;
+  if (i == n) return;
+  queue_set(q, i, q[n]);
+  sift_up(q, i);
+  sift_down(q, n, q[i]->pos);
+}
+
+void event_init(Event *e, const char *name, int clock, event_handler_t handler, void *arg) {
+  assert(nr_event < MAX_EVENT);
+  assert(clock >= 0 && clock < NR_EVENT_CLOCK);
+  *e = (Event){ .name = name, .clock = clock, .handler = handler, .arg = arg, .pos = -1 };
+  events[nr_event ++] = e;
+}
+
+void event_schedule(Event *e, uint64_t when, uint64_t period) {
+  if (e->pos >= 0) queue_remove(e);
+  e->when = when;
+  e->period = period;
+  queue_insert(e);
+  // let the next check compute the deadline again
+  g_device_deadline = 0;
+}
+
+void event_cancel(Event *e) {
+  if (e->pos >= 0) queue_remove(e);
+}
+
+uint64_t event_now(int clock) {
+  return clock == EVENT_INST ? g_nr_guest_inst : get_time();
+}
+
+static void run_due(int clock, uint64_t now) {
+  while (nr_queue[clock] > 0 && queue[clock][0]->when <= now) {
+    Event *e = queue[clock][0];
+    queue_remove(e);
+    if (e->period != 0) {
+      // the handler may still cancel or move it
+      e->when += e->period;
+      if (e->when <= now) e->when = now + e->period;
+      queue_insert(e);
+    }
+    e->nr_fire ++;
+    e->handler(e->arg);
+  }
+}
+
+static uint64_t next_budget(uint64_t now) {
+  static uint64_t budget = BUDGET_MIN;
+  static uint64_t last_time = 0, last_inst = 0;
+  if (last_time == 0) {
+    last_time = now;
+    last_inst = g_nr_guest_inst;
+  }
+  uint64_t us = now - last_time;
+  // a shorter sample is too noisy to measure the speed
+  if (us < SAMPLE_US / 4) return budget;
+  uint64_t speed_budget = (g_nr_guest_inst - last_inst) * SAMPLE_US / us;
+  // Follow a slowdown at once, since the events are late until the budget
+  // runs out, but smooth out the noise of a speedup.
+  budget = (speed_budget < budget ? speed_budget : (budget + speed_budget) / 2);
+  if (budget < BUDGET_MIN) budget = BUDGET_MIN;
+  if (budget > BUDGET_MAX) budget = BUDGET_MAX;
+  last_time = now;
+  last_inst = g_nr_guest_inst;
+  return budget;
+}
+
+void event_run() {
+  run_due(EVENT_INST, g_nr_guest_inst);
+  uint64_t deadline = UINT64_MAX;
+  if (nr_queue[EVENT_HOST] > 0) {
+    uint64_t now = get_time();
+    run_due(EVENT_HOST, now);
+    deadline = g_nr_guest_inst + next_budget(now);
+  }
+  if (nr_queue[EVENT_INST] > 0 && queue[EVENT_INST][0]->when < deadline) {
+    deadline = queue[EVENT_INST][0]->when;
+  }
+  g_device_deadline = deadline;
+}
+
+// the pending events saved into snapshots, in the order of event_init()
+static struct {
+  uint64_t when;
+  uint64_t period;
+  bool pending;
+} event_state[MAX_EVENT] = {};
+
+static void event_sync(bool restore) {
+  int i;
+  if (!restore) {
+    for (i = 0; i < nr_event; i ++) {
+      event_state[i].when = events[i]->when;
+      event_state[i].period = events[i]->period;
+      event_state[i].pending = (events[i]->pos >= 0);
+    }
+    return;
+  }
+  for (i = 0; i < nr_event; i ++) {
+    event_cancel(events[i]);
+    if (event_state[i].pending) {
+      event_schedule(events[i], event_state[i].when, event_state[i].period);
+    }
+  }
+}
+
+void event_snapshot_add() {
+  snapshot_add("event", event_state, sizeof(event_state), event_sync);
+}
+
+void event_display() {
+  int i;
+  for (i = 0; i < nr_event; i ++) {
+    Event *e = events[i];
+    printf("%-12s %s %" PRIu64 " fires", e->name,
+        e->clock == EVENT_INST ? "inst" : "host", e->nr_fire);
+    if (e->pos >= 0) {
+      uint64_t now = event_now(e->clock);
+      printf(", next in %" PRIu64 " %s", e->when > now ? e->when - now : 0,
+          e->clock == EVENT_INST ? "instructions" : "us");
+      if (e->period != 0) printf(", every %" PRIu64, e->period);
+    }
+    printf("\n");
+  }
+}
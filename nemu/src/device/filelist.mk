@@ -14,7 +14,7 @@
 #**************************************************************************************/
 
 DIRS-y += src/device/io
-SRCS-$(CONFIG_DEVICE) += src/device/device.c src/device/alarm.c src/device/intr.c
+SRCS-$(CONFIG_DEVICE) += src/device/device.c src/device/event.c src/device/intr.c
 SRCS-$(CONFIG_HAS_SERIAL) += src/device/serial.c
 SRCS-$(CONFIG_HAS_TIMER) += src/device/timer.c
 SRCS-$(CONFIG_HAS_KEYBOARD) += src/device/keyboard.c
@@ -23,7 +23,7 @@ SRCS-$(CONFIG_HAS_AUDIO) += src/device/audio.c
 SRCS-$(CONFIG_HAS_DISK) += src/device/disk.c
 SRCS-$(CONFIG_HAS_SDCARD) += src/device/sdcard.c
 
-SRCS-BLACKLIST-$(CONFIG_TARGET_AM) += src/device/alarm.c
+LIBS += $(if $(CONFIG_VGA_CAPTURE)$(CONFIG_SERIAL_BUFFERED)$(CONFIG_SERIAL_INPUT_FIFO),-lpthread,)
 
 ifdef CONFIG_DEVICE
 ifndef CONFIG_TARGET_AM
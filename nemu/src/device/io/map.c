@@ -52,10 +52,16 @@ void init_map() {
   p_space = io_space;
 }
 
+// called after all devices are initialized, when io_space stops growing
+void map_snapshot_add() {
+  snapshot_add("io_space", io_space, p_space - io_space, NULL);
+}
+
 word_t map_read(paddr_t addr, int len, IOMap *map) {
   assert(len >= 1 && len <= 8);
   check_bound(map, addr);
   paddr_t offset = addr - map->low;
+  map->nr_access ++;
   invoke_callback(map->callback, offset, len, false); // prepare data to read
   word_t ret = host_read(map->space + offset, len);
   return ret;
@@ -65,6 +71,16 @@ void map_write(paddr_t addr, int len, word_t data, IOMap *map) {
   assert(len >= 1 && len <= 8);
   check_bound(map, addr);
   paddr_t offset = addr - map->low;
+  map->nr_access ++;
   host_write(map->space + offset, len, data);
   invoke_callback(map->callback, offset, len, true);
 }
+
+void map_display(IOMap *maps, int nr_map) {
+  int i;
+  for (i = 0; i < nr_map; i ++) {
+    printf("%-12s [" FMT_PADDR ", " FMT_PADDR "] %" PRIu64 " accesses%s\n",
+        maps[i].name, maps[i].low, maps[i].high, maps[i].nr_access,
+        maps[i].passive ? " (passive, not counted)" : "");
+  }
+}
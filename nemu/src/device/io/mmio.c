@@ -14,16 +14,49 @@
 ***************************************************************************************/
 
 #include <device/map.h>
+#include <device/mmio.h>
 #include <memory/paddr.h>
+#include <memory/region.h>
+#include <memory/vaddr.h>
 
 #define NR_MAP 16
 
 static IOMap maps[NR_MAP] = {};
 static int nr_map = 0;
 
+// The maps are found by a radix tree indexed by the 32-bit address. A leaf
+// holds the map ID + 1 of each MMIO_GRAIN bytes in a page, so maps sharing
+// one page are also resolved with three lookups.
+#define MMIO_GRAIN_SHIFT 2
+#define MMIO_GRAIN (1 << MMIO_GRAIN_SHIFT)
+#define MMIO_DIR_SHIFT 22
+
+typedef uint8_t MMIOLeaf[PAGE_SIZE >> MMIO_GRAIN_SHIFT];
+typedef MMIOLeaf *MMIODir[1 << (MMIO_DIR_SHIFT - PAGE_SHIFT)];
+static MMIODir *mmio_dir[1 << (32 - MMIO_DIR_SHIFT)] = {};
+
+static uint8_t* mmio_slot(paddr_t addr, bool alloc) {
+  if ((uint64_t)addr >> 32) return NULL;
+  MMIODir **dir = &mmio_dir[(uint32_t)addr >> MMIO_DIR_SHIFT];
+  if (*dir == NULL) {
+    if (!alloc) return NULL;
+    *dir = calloc(1, sizeof(MMIODir));
+    assert(*dir);
+  }
+  MMIOLeaf **leaf = &(**dir)[(addr >> PAGE_SHIFT) % ARRLEN(**dir)];
+  if (*leaf == NULL) {
+    if (!alloc) return NULL;
+    *leaf = calloc(1, sizeof(MMIOLeaf));
+    assert(*leaf);
+  }
+  return &(**leaf)[(addr & PAGE_MASK) >> MMIO_GRAIN_SHIFT];
+}
+
 static IOMap* fetch_mmio_map(paddr_t addr) {
-  int mapid = find_mapid_by_addr(maps, nr_map, addr);
-  return (mapid == -1 ? NULL : &maps[mapid]);
+  uint8_t *slot = mmio_slot(addr, false);
+  if (slot == NULL || *slot == 0) return NULL;
+  difftest_skip_ref();
+  return &maps[*slot - 1];
 }
 
 static void report_mmio_overlap(const char *name1, paddr_t l1, paddr_t r1,
@@ -39,6 +72,14 @@ void add_mmio_map(const char *name, paddr_t addr, void *space, uint32_t len, io_
   if (in_pmem(left) || in_pmem(right)) {
     report_mmio_overlap(name, left, right, "pmem", PMEM_LEFT, PMEM_RIGHT);
   }
+#ifdef CONFIG_MEM_REGION
+  for (int i = 0; i < nr_mem_region; i++) {
+    MemRegion *r = &mem_region[i];
+    if (left <= r->low + r->size - 1 && right >= r->low) {
+      report_mmio_overlap(name, left, right, r->name, r->low, r->low + r->size - 1);
+    }
+  }
+#endif
   for (int i = 0; i < nr_map; i++) {
     if (left <= maps[i].high && right >= maps[i].low) {
       report_mmio_overlap(name, left, right, maps[i].name, maps[i].low, maps[i].high);
@@ -50,14 +91,62 @@ void add_mmio_map(const char *name, paddr_t addr, void *space, uint32_t len, io_
   Log("Add mmio map '%s' at [" FMT_PADDR ", " FMT_PADDR "]",
       maps[nr_map].name, maps[nr_map].low, maps[nr_map].high);
 
+  Assert((uint64_t)right >> 32 == 0, "MMIO region %s is beyond 4GB", name);
+  uint64_t a;
+  for (a = left & ~(paddr_t)(MMIO_GRAIN - 1); a <= right; a += MMIO_GRAIN) {
+    uint8_t *slot = mmio_slot(a, true);
+    Assert(*slot == 0, "MMIO region %s shares %d bytes at " FMT_PADDR " with %s",
+        name, MMIO_GRAIN, (paddr_t)a, maps[*slot - 1].name);
+    *slot = nr_map + 1;
+  }
+
   nr_map ++;
 }
 
+MMIOMem mmio_mem[NR_MMIO_MEM] = {};
+int nr_mmio_mem = 0;
+
+void add_mmio_mem(const char *name, paddr_t addr, void *space, uint32_t len,
+    uint8_t *dirty) {
+  assert(nr_mmio_mem < NR_MMIO_MEM);
+  add_mmio_map(name, addr, space, len, NULL);
+  maps[nr_map - 1].passive = true;
+  mmio_mem[nr_mmio_mem ++] = (MMIOMem){ .low = addr, .size = len, .space = space,
+    .dirty = dirty };
+}
+
+void mmio_display() {
+  map_display(maps, nr_map);
+}
+
+paddr_t mmio_map_span(paddr_t addr) {
+  uint8_t *slot = mmio_slot(addr, false);
+  if (slot == NULL || *slot == 0 || addr > maps[*slot - 1].high) return 0;
+  return maps[*slot - 1].high - addr + 1;
+}
+
+void mmio_peek(paddr_t addr, void *buf, size_t len) {
+  uint8_t *slot = mmio_slot(addr, false);
+  assert(slot != NULL && *slot != 0);
+  IOMap *map = &maps[*slot - 1];
+  device_lock();
+  memcpy(buf, (uint8_t *)map->space + (addr - map->low), len);
+  device_unlock();
+}
+
 /* bus interface */
 word_t mmio_read(paddr_t addr, int len) {
-  return map_read(addr, len, fetch_mmio_map(addr));
+  device_lock();
+  word_t ret = map_read(addr, len, fetch_mmio_map(addr));
+  device_unlock();
+  return ret;
 }
 
 void mmio_write(paddr_t addr, int len, word_t data) {
+  device_lock();
   map_write(addr, len, data, fetch_mmio_map(addr));
+  // passive regions are accessed here while difftest is attached
+  MMIOMem *m = mmio_mem_find(addr, len);
+  if (m != NULL) mmio_mem_dirty(m, addr, len);
+  device_unlock();
 }
@@ -20,6 +20,8 @@
 #define NR_MAP 16
 static IOMap maps[NR_MAP] = {};
 static int nr_map = 0;
+// the map ID + 1 of each port
+static uint8_t port_map[PORT_IO_SPACE_MAX] = {};
 
 /* device interface */
 void add_pio_map(const char *name, ioaddr_t addr, void *space, uint32_t len, io_callback_t callback) {
@@ -30,20 +32,33 @@ void add_pio_map(const char *name, ioaddr_t addr, void *space, uint32_t len, io_
   Log("Add port-io map '%s' at [" FMT_PADDR ", " FMT_PADDR "]",
       maps[nr_map].name, maps[nr_map].low, maps[nr_map].high);
 
+  uint32_t i;
+  for (i = addr; i < addr + len; i ++) {
+    Assert(port_map[i] == 0, "port-io map %s is overlapped with %s at port %d",
+        name, maps[port_map[i] - 1].name, i);
+    port_map[i] = nr_map + 1;
+  }
+
   nr_map ++;
 }
 
+static IOMap* fetch_pio_map(ioaddr_t addr) {
+  assert(port_map[addr] != 0);
+  difftest_skip_ref();
+  return &maps[port_map[addr] - 1];
+}
+
+void pio_display() {
+  map_display(maps, nr_map);
+}
+
 /* CPU interface */
 uint32_t pio_read(ioaddr_t addr, int len) {
   assert(addr + len - 1 < PORT_IO_SPACE_MAX);
-  int mapid = find_mapid_by_addr(maps, nr_map, addr);
-  assert(mapid != -1);
-  return map_read(addr, len, &maps[mapid]);
+  return map_read(addr, len, fetch_pio_map(addr));
 }
 
 void pio_write(ioaddr_t addr, int len, uint32_t data) {
   assert(addr + len - 1 < PORT_IO_SPACE_MAX);
-  int mapid = find_mapid_by_addr(maps, nr_map, addr);
-  assert(mapid != -1);
-  map_write(addr, len, data, &maps[mapid]);
+  map_write(addr, len, data, fetch_pio_map(addr));
 }
@@ -48,6 +48,11 @@ static uint32_t addr = 0;
 static bool write_cmd = 0;
 static bool read_ext_csd = false;
 
+// the image is not saved, only the position of the transfer in it
+static void sdcard_sync(bool restore) {
+  if (restore && fp) fseek(fp, (blk_addr << 9) + addr, SEEK_SET);
+}
+
 static void prepare_rw(int is_write) {
   blk_addr = base[SDARG];
   addr = 0;
@@ -131,4 +136,10 @@ void init_sdcard() {
   const char *img = CONFIG_SDCARD_IMG_PATH;
   fp = fopen(img, "r+");
   if (fp == NULL) Log("Can not find sdcard image: %s", img);
+
+  snapshot_add("sdcard.blkcnt", &blkcnt, sizeof(blkcnt), NULL);
+  snapshot_add("sdcard.blk_addr", &blk_addr, sizeof(blk_addr), NULL);
+  snapshot_add("sdcard.addr", &addr, sizeof(addr), NULL);
+  snapshot_add("sdcard.write_cmd", &write_cmd, sizeof(write_cmd), NULL);
+  snapshot_add("sdcard.read_ext_csd", &read_ext_csd, sizeof(read_ext_csd), sdcard_sync);
 }
@@ -15,28 +15,280 @@
 
 #include <utils.h>
 #include <device/map.h>
+#if defined(CONFIG_SERIAL_BUFFERED) || defined(CONFIG_SERIAL_INPUT_FIFO)
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 /* http://en.wikibooks.org/wiki/Serial_Programming/8250_UART_Programming */
 // NOTE: this is compatible to 16550
 
 #define CH_OFFSET 0
+#define FCR_OFFSET 2
+#define LCR_OFFSET 3
+#define LSR_OFFSET 5
+
+#define FCR_CLEAR_RX 0x02
+#define LCR_DLAB 0x80
+#define LSR_DR   0x01 // data ready
+#define LSR_THRE 0x20 // transmitter holding register empty
+#define LSR_TEMT 0x40 // transmitter empty
 
 static uint8_t *serial_base = NULL;
 
+#ifdef CONFIG_SERIAL_BUFFERED
+// The CPU thread puts the characters into a single-producer single-consumer
+// ring, and the writer thread takes them out. Each of them only moves its
+// own index, so putting a character takes no lock. The writer is woken up
+// at a newline or when another half of the ring is filled, and drains the
+// ring anyway every FLUSH_US.
+#define RING_SIZE (1 << 16)
+#define FLUSH_US 10000
+
+static char ring[RING_SIZE];
+static uint64_t ring_head = 0; // only written by the CPU thread
+static uint64_t ring_tail = 0; // only written by the writer thread
+static int serial_fd = STDERR_FILENO;
+static bool writer_kicked = false, writer_stop = false;
+static pthread_mutex_t writer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t drain_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t writer_tid;
+
+static void ring_write(uint64_t tail, uint64_t head) {
+  while (tail != head) {
+    uint64_t len = head - tail;
+    uint64_t off = tail % RING_SIZE;
+    if (len > RING_SIZE - off) len = RING_SIZE - off;
+    ssize_t ret = write(serial_fd, ring + off, len);
+    if (ret < 0 && errno == EINTR) continue;
+    // drop the output if it can not be written, rather than blocking the guest
+    tail += (ret < 0 ? len : ret);
+    __atomic_store_n(&ring_tail, tail, __ATOMIC_RELEASE);
+  }
+}
+
+static void *writer_thread(void *arg) {
+  pthread_mutex_lock(&writer_mutex);
+  while (true) {
+    uint64_t head = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+    if (head != ring_tail) {
+      pthread_mutex_unlock(&writer_mutex);
+      ring_write(ring_tail, head);
+      pthread_mutex_lock(&writer_mutex);
+      continue;
+    }
+    pthread_cond_broadcast(&drain_cond);
+    if (writer_stop) break;
+    if (!writer_kicked) {
+      struct timespec ts;
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_nsec += FLUSH_US * 1000;
+      if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec ++;
+        ts.tv_nsec -= 1000000000;
+      }
+      pthread_cond_timedwait(&writer_cond, &writer_mutex, &ts);
+    }
+    writer_kicked = false;
+  }
+  pthread_mutex_unlock(&writer_mutex);
+  return NULL;
+}
+
+static void writer_kick() {
+  pthread_mutex_lock(&writer_mutex);
+  writer_kicked = true;
+  pthread_cond_signal(&writer_cond);
+  pthread_mutex_unlock(&writer_mutex);
+}
+
+// wait until the writer thread has written out everything put so far
+void serial_flush() {
+  pthread_mutex_lock(&writer_mutex);
+  if (__atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE) != ring_head) {
+    writer_kicked = true;
+    pthread_cond_signal(&writer_cond);
+    while (__atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE) != ring_head) {
+      pthread_cond_wait(&drain_cond, &writer_mutex);
+    }
+  }
+  pthread_mutex_unlock(&writer_mutex);
+}
+
+static void serial_putc(char ch) {
+  uint64_t head = ring_head;
+  if (head - __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE) == RING_SIZE) {
+    serial_flush();
+  }
+  ring[head % RING_SIZE] = ch;
+  __atomic_store_n(&ring_head, head + 1, __ATOMIC_RELEASE);
+  if (ch == '\n' || (head + 1) % (RING_SIZE / 2) == 0) writer_kick();
+}
+
+static void start_writer_thread() {
+  int ret = pthread_create(&writer_tid, NULL, writer_thread, NULL);
+  Assert(ret == 0, "Can not create the serial writer thread");
+}
 
+// NEMU goes on in the child of the fork() for checkpoints, which only has
+// the forking thread. The ring is drained before forking, so the child
+// does not write the same output again with its own writer thread.
+static void writer_atfork_prepare() {
+  serial_flush();
+  pthread_mutex_lock(&writer_mutex);
+}
+static void writer_atfork_parent() { pthread_mutex_unlock(&writer_mutex); }
+static void writer_atfork_child() {
+  pthread_mutex_init(&writer_mutex, NULL);
+  pthread_cond_init(&writer_cond, NULL);
+  pthread_cond_init(&drain_cond, NULL);
+  start_writer_thread();
+}
+
+static void writer_close() {
+  pthread_mutex_lock(&writer_mutex);
+  writer_stop = true;
+  pthread_cond_signal(&writer_cond);
+  pthread_mutex_unlock(&writer_mutex);
+  pthread_join(writer_tid, NULL);
+  if (serial_fd != STDERR_FILENO) close(serial_fd);
+}
+
+static void init_writer() {
+  const char *file = CONFIG_SERIAL_OUTPUT_FILE;
+  if (file[0] != '\0') {
+    serial_fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    Assert(serial_fd >= 0, "Can not open '%s' for the serial output", file);
+    Log("Write the serial output to %s", file);
+  }
+  start_writer_thread();
+  pthread_atfork(writer_atfork_prepare, writer_atfork_parent, writer_atfork_child);
+  atexit(writer_close);
+}
+#else
 static void serial_putc(char ch) {
   MUXDEF(CONFIG_TARGET_AM, putch(ch), putc(ch, stderr));
 }
+#endif
+
+#ifdef CONFIG_SERIAL_INPUT_FIFO
+// The reader thread puts the host input into a single-producer
+// single-consumer ring, and the CPU thread takes it out, so polling LSR
+// from the guest only compares the two indices. The reader blocks in
+// read(), and stops reading while the ring is full, which stalls the
+// writer on the other side of the pipe.
+#define RX_SIZE 4096
+#define RX_FULL_WAIT_US 1000
+
+static uint8_t rx_ring[RX_SIZE];
+static uint64_t rx_head = 0; // only written by the reader thread
+static uint64_t rx_tail = 0; // only written by the CPU thread
+static int rx_fd = -1;
+static bool rx_running = false;
+static pthread_t rx_tid;
+
+static void *reader_thread(void *arg) {
+  uint8_t buf[256];
+  while (true) {
+    uint64_t free = RX_SIZE - (rx_head - __atomic_load_n(&rx_tail, __ATOMIC_ACQUIRE));
+    if (free == 0) {
+      usleep(RX_FULL_WAIT_US);
+      continue;
+    }
+    // never read more than what fits, so the thread can be cancelled at
+    // read() and usleep() without losing any input
+    ssize_t n = read(rx_fd, buf, free < sizeof(buf) ? free : sizeof(buf));
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    ssize_t i;
+    for (i = 0; i < n; i ++) {
+      rx_ring[(rx_head + i) % RX_SIZE] = buf[i];
+    }
+    __atomic_store_n(&rx_head, rx_head + n, __ATOMIC_RELEASE);
+  }
+  return NULL;
+}
+
+// The reader thread is started by the first access of the guest to the
+// serial port. The processes forked for checkpoints and for the supervisor
+// which do not run the guest then never read the input away from the one
+// which does.
+static void start_reader_thread() {
+  int ret = pthread_create(&rx_tid, NULL, reader_thread, NULL);
+  Assert(ret == 0, "Can not create the serial reader thread");
+  rx_running = true;
+}
+
+static void stop_reader_thread() {
+  if (!rx_running) return;
+  pthread_cancel(rx_tid);
+  pthread_join(rx_tid, NULL);
+  rx_running = false;
+}
+
+static bool rx_ready() {
+  if (!rx_running) start_reader_thread();
+  return __atomic_load_n(&rx_head, __ATOMIC_ACQUIRE) != rx_tail;
+}
+
+static uint8_t rx_getc() {
+  if (!rx_ready()) return 0;
+  uint8_t ch = rx_ring[rx_tail % RX_SIZE];
+  __atomic_store_n(&rx_tail, rx_tail + 1, __ATOMIC_RELEASE);
+  return ch;
+}
+
+static void rx_clear() {
+  __atomic_store_n(&rx_tail, __atomic_load_n(&rx_head, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+}
+
+static void init_reader() {
+  const char *file = CONFIG_SERIAL_INPUT_PATH;
+  pthread_atfork(stop_reader_thread, NULL, NULL);
+  if (file[0] == '\0') {
+    rx_fd = STDIN_FILENO;
+    Log("Read the serial input from stdin");
+    return;
+  }
+  if (mkfifo(file, 0644) != 0 && errno != EEXIST) {
+    panic("Can not create the named pipe '%s'", file);
+  }
+  // opened for writing as well, so that read() waits for the next writer
+  // instead of returning EOF when the last one closes the pipe
+  rx_fd = open(file, O_RDWR);
+  Assert(rx_fd >= 0, "Can not open '%s' for the serial input", file);
+  Log("Read the serial input from %s", file);
+}
+#endif
 
 static void serial_io_handler(uint32_t offset, int len, bool is_write) {
   assert(len == 1);
+  bool dlab = (serial_base[LCR_OFFSET] & LCR_DLAB) != 0;
   switch (offset) {
     /* We bind the serial port with the host stderr in NEMU. */
     case CH_OFFSET:
+      if (dlab) break; // the divisor latch, the baud rate makes no difference
       if (is_write) serial_putc(serial_base[0]);
-      else panic("do not support read");
+      else serial_base[0] = MUXDEF(CONFIG_SERIAL_INPUT_FIFO, rx_getc(), 0);
       break;
-    default: panic("do not support offset = %d", offset);
+    case FCR_OFFSET:
+      if (is_write && (serial_base[FCR_OFFSET] & FCR_CLEAR_RX)) {
+        IFDEF(CONFIG_SERIAL_INPUT_FIFO, rx_clear());
+      }
+      // IIR: no interrupt is pending
+      if (!is_write) serial_base[FCR_OFFSET] = 0x01;
+      break;
+    case LSR_OFFSET:
+      if (is_write) break;
+      serial_base[LSR_OFFSET] = LSR_THRE | LSR_TEMT |
+        (MUXDEF(CONFIG_SERIAL_INPUT_FIFO, rx_ready(), false) ? LSR_DR : 0);
+      break;
+    // the other registers keep the values written by the guest
+    default: break;
   }
 }
 
@@ -47,5 +299,6 @@ void init_serial() {
 #else
   add_mmio_map("serial", CONFIG_SERIAL_MMIO, serial_base, 8, serial_io_handler);
 #endif
-
+  IFDEF(CONFIG_SERIAL_BUFFERED, init_writer());
+  IFDEF(CONFIG_SERIAL_INPUT_FIFO, init_reader());
 }
@@ -14,7 +14,7 @@
 ***************************************************************************************/
 
 #include <device/map.h>
-#include <device/alarm.h>
+#include <device/event.h>
 #include <utils.h>
 
 static uint32_t *rtc_port_base = NULL;
@@ -22,14 +22,16 @@ static uint32_t *rtc_port_base = NULL;
 static void rtc_io_handler(uint32_t offset, int len, bool is_write) {
   assert(offset == 0 || offset == 4);
   if (!is_write && offset == 4) {
-    uint64_t us = get_time();
+    uint64_t us = get_guest_time();
     rtc_port_base[0] = (uint32_t)us;
     rtc_port_base[1] = us >> 32;
   }
 }
 
 #ifndef CONFIG_TARGET_AM
-static void timer_intr() {
+static Event timer_event;
+
+static void timer_intr(void *arg) {
   if (nemu_state.state == NEMU_RUNNING) {
     extern void dev_raise_intr();
     dev_raise_intr();
@@ -44,5 +46,9 @@ void init_timer() {
 #else
   add_mmio_map("rtc", CONFIG_RTC_MMIO, rtc_port_base, 8, rtc_io_handler);
 #endif
-  IFNDEF(CONFIG_TARGET_AM, add_alarm_handle(timer_intr));
+#ifndef CONFIG_TARGET_AM
+  event_init(&timer_event, "timer", EVENT_GUEST, timer_intr, NULL);
+  event_schedule(&timer_event, event_now(EVENT_GUEST) + EVENT_GUEST_PERIOD(TIMER_HZ),
+      EVENT_GUEST_PERIOD(TIMER_HZ));
+#endif
 }
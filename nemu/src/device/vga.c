@@ -15,6 +15,7 @@
 
 #include <common.h>
 #include <device/map.h>
+#include <device/mmio.h>
 
 #define SCREEN_W (MUXDEF(CONFIG_VGA_SIZE_800x600, 800, 400))
 #define SCREEN_H (MUXDEF(CONFIG_VGA_SIZE_800x600, 600, 300))
@@ -34,6 +35,18 @@ static uint32_t screen_size() {
 static void *vmem = NULL;
 static uint32_t *vgactl_port_base = NULL;
 
+// Writes to vmem mark the dirty map, and only the scanlines covered by the
+// dirty grains are uploaded when the guest syncs. A sync with nothing dirty
+// does not redraw the screen at all.
+static uint8_t *vmem_dirty = NULL;
+static uint32_t nr_dirty = 0;
+static uint64_t nr_sync = 0, nr_frame = 0, nr_upload = 0;
+
+// the screen is redrawn as a whole after the vmem is restored
+static void vga_sync(bool restore) {
+  if (restore) memset(vmem_dirty, 1, nr_dirty);
+}
+
 #ifdef CONFIG_VGA_SHOW_SCREEN
 #ifndef CONFIG_TARGET_AM
 #include <SDL2/SDL.h>
@@ -56,8 +69,13 @@ static void init_screen() {
   SDL_RenderPresent(renderer);
 }
 
-static inline void update_screen() {
-  SDL_UpdateTexture(texture, NULL, vmem, SCREEN_W * sizeof(uint32_t));
+static inline void upload_rows(uint32_t y, uint32_t h) {
+  SDL_Rect rect = { .x = 0, .y = y, .w = SCREEN_W, .h = h };
+  SDL_UpdateTexture(texture, &rect, (uint32_t *)vmem + y * SCREEN_W,
+      SCREEN_W * sizeof(uint32_t));
+}
+
+static inline void present_screen() {
   SDL_RenderClear(renderer);
   SDL_RenderCopy(renderer, texture, NULL, NULL);
   SDL_RenderPresent(renderer);
@@ -65,15 +83,210 @@ static inline void update_screen() {
 #else
 static void init_screen() {}
 
-static inline void update_screen() {
-  io_write(AM_GPU_FBDRAW, 0, 0, vmem, screen_width(), screen_height(), true);
+static inline void upload_rows(uint32_t y, uint32_t h) {
+  io_write(AM_GPU_FBDRAW, 0, y, (uint32_t *)vmem + y * screen_width(),
+      screen_width(), h, false);
+}
+
+static inline void present_screen() {
+  io_write(AM_GPU_FBDRAW, 0, 0, NULL, 0, 0, true);
 }
 #endif
+
+static inline void upload_run(uint32_t first, uint32_t end) {
+  if (end <= first) return;
+  upload_rows(first, end - first);
+  nr_upload += (uint64_t)(end - first) * screen_width() * sizeof(uint32_t);
+}
+
+// upload the runs of scanlines covered by the dirty grains
+static inline bool update_screen() {
+  uint32_t pitch = screen_width() * sizeof(uint32_t);
+  uint32_t h = screen_height();
+  uint32_t first = 0, end = 0; // the current run is [first, end)
+  bool dirty = false;
+  uint32_t i;
+  for (i = 0; i < nr_dirty; i ++) {
+    if (!vmem_dirty[i]) continue;
+    // cleared before the upload, so a write during it is marked again
+    vmem_dirty[i] = 0;
+    dirty = true;
+    uint32_t y0 = ((uint64_t)i << MMIO_DIRTY_SHIFT) / pitch;
+    uint32_t y1 = (((uint64_t)(i + 1) << MMIO_DIRTY_SHIFT) - 1) / pitch + 1;
+    if (y1 > h) y1 = h;
+    if (y0 > end) {
+      upload_run(first, end);
+      first = y0;
+    }
+    end = y1;
+  }
+  upload_run(first, end);
+  if (dirty) present_screen();
+  return dirty;
+}
+#endif
+
+#ifdef CONFIG_VGA_CAPTURE
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+// The synced frames are copied to `pending` by the CPU thread, and encoded
+// to YUV4MPEG2 and written by the capture thread. A frame is skipped if the
+// capture thread has not taken the previous one yet, so the CPU thread never
+// waits for the encoder. The guest time is split into slots of one frame
+// each, and the latest frame is written again for every slot without a new
+// one, so the video plays at the speed of the guest.
+static int capture_fd = -1;
+static uint32_t *pending = NULL, *work = NULL;
+static uint8_t *yuv = NULL;
+static bool has_pending = false, capture_stop = false;
+static pthread_mutex_t capture_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t capture_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t capture_tid;
+static uint64_t first_capture = 0, last_slot = 0;
+// times to write the last written frame again, and the pending frame again
+static uint64_t nr_repeat = 0, pending_repeat = 0;
+static uint64_t nr_capture = 0, nr_skip = 0, nr_dup = 0;
+
+#define FRAME_MAGIC "FRAME\n"
+
+// BT.601 with the studio range, each plane at the full resolution (C444)
+static void encode_frame(const uint32_t *p, uint8_t *out) {
+  int n = SCREEN_W * SCREEN_H, i;
+  uint8_t *y = out, *u = out + n, *v = out + 2 * n;
+  for (i = 0; i < n; i ++) {
+    int r = (p[i] >> 16) & 0xff, g = (p[i] >> 8) & 0xff, b = p[i] & 0xff;
+    y[i] = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+    u[i] = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+    v[i] = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+  }
+}
+
+static void *capture_thread(void *arg) {
+  size_t size = strlen(FRAME_MAGIC) + SCREEN_W * SCREEN_H * 3;
+  pthread_mutex_lock(&capture_mutex);
+  while (true) {
+    while (!has_pending && nr_repeat == 0 && !capture_stop) {
+      pthread_cond_wait(&capture_cond, &capture_mutex);
+    }
+    uint64_t repeat = nr_repeat;
+    bool take = has_pending;
+    nr_repeat = 0;
+    if (take) {
+      uint32_t *p = pending;
+      pending = work;
+      work = p;
+      has_pending = false;
+      // the taken frame is the last written one from now on
+      nr_repeat = pending_repeat;
+      pending_repeat = 0;
+    } else if (repeat == 0) break;
+    pthread_mutex_unlock(&capture_mutex);
+
+    // a whole frame in one write(), the file offset is shared with the
+    // checkpoints forked from this process
+    for (; repeat > 0; repeat --) {
+      if (write(capture_fd, yuv, size) != size) Log("Can not write the captured frame");
+    }
+    if (take) {
+      encode_frame(work, yuv + strlen(FRAME_MAGIC));
+      if (write(capture_fd, yuv, size) != size) Log("Can not write the captured frame");
+    }
+
+    pthread_mutex_lock(&capture_mutex);
+  }
+  pthread_mutex_unlock(&capture_mutex);
+  return NULL;
+}
+
+static void capture_frame() {
+  uint64_t now = get_guest_time();
+  if (nr_capture == 0) first_capture = now;
+  uint64_t slot = (now - first_capture) / (1000000 / CONFIG_VGA_CAPTURE_FPS);
+  if (nr_capture > 0 && slot == last_slot) return;
+  // the slots between the two syncs show the latest frame
+  uint64_t gap = (nr_capture > 0 ? slot - last_slot - 1 : 0);
+  last_slot = slot;
+  pthread_mutex_lock(&capture_mutex);
+  if (has_pending) {
+    // this slot also shows the pending frame
+    pending_repeat += gap + 1;
+    nr_dup += gap + 1;
+    nr_skip ++;
+  } else {
+    nr_repeat += gap;
+    nr_dup += gap;
+    memcpy(pending, vmem, screen_size());
+    has_pending = true;
+    nr_capture ++;
+  }
+  pthread_cond_signal(&capture_cond);
+  pthread_mutex_unlock(&capture_mutex);
+}
+
+static void start_capture_thread() {
+  int ret = pthread_create(&capture_tid, NULL, capture_thread, NULL);
+  Assert(ret == 0, "Can not create the capture thread");
+}
+
+// NEMU goes on in the child of the fork() for checkpoints, which only has
+// the forking thread, so the capture thread is created again there
+static void capture_atfork_prepare() { pthread_mutex_lock(&capture_mutex); }
+static void capture_atfork_parent() { pthread_mutex_unlock(&capture_mutex); }
+static void capture_atfork_child() {
+  pthread_mutex_init(&capture_mutex, NULL);
+  pthread_cond_init(&capture_cond, NULL);
+  start_capture_thread();
+}
+
+// write the frame taken last and stop the capture thread
+static void capture_close() {
+  pthread_mutex_lock(&capture_mutex);
+  capture_stop = true;
+  pthread_cond_signal(&capture_cond);
+  pthread_mutex_unlock(&capture_mutex);
+  pthread_join(capture_tid, NULL);
+  close(capture_fd);
+}
+
+static void init_capture() {
+  const char *file = CONFIG_VGA_CAPTURE_FILE;
+  capture_fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  Assert(capture_fd >= 0, "Can not open '%s' to capture the screen", file);
+  char header[64];
+  int len = snprintf(header, sizeof(header), "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444\n",
+      SCREEN_W, SCREEN_H, CONFIG_VGA_CAPTURE_FPS);
+  Assert(write(capture_fd, header, len) == len, "Can not write to '%s'", file);
+  pending = malloc(screen_size());
+  work = malloc(screen_size());
+  yuv = malloc(strlen(FRAME_MAGIC) + SCREEN_W * SCREEN_H * 3);
+  assert(pending && work && yuv);
+  memcpy(yuv, FRAME_MAGIC, strlen(FRAME_MAGIC));
+  start_capture_thread();
+  pthread_atfork(capture_atfork_prepare, capture_atfork_parent, capture_atfork_child);
+  atexit(capture_close);
+  Log("Capture the screen to %s", file);
+}
 #endif
 
 void vga_update_screen() {
-  // TODO: call `update_screen()` when the sync register is non-zero,
-  // then zero out the sync register
+  if (vgactl_port_base[1] == 0) return;
+  nr_sync ++;
+  IFDEF(CONFIG_VGA_SHOW_SCREEN, if (update_screen()) nr_frame ++);
+  IFDEF(CONFIG_VGA_CAPTURE, capture_frame());
+  vgactl_port_base[1] = 0;
+}
+
+void vga_statistic() {
+  printf("vga: %" PRIu64 " syncs, %" PRIu64 " frames redrawn, %" PRIu64 " bytes uploaded",
+      nr_sync, nr_frame, nr_upload);
+  if (nr_frame > 0) {
+    printf(", %" PRIu64 " bytes per frame of %u", nr_upload / nr_frame, screen_size());
+  }
+  IFDEF(CONFIG_VGA_CAPTURE, printf(", %" PRIu64 " frames captured, %" PRIu64 " skipped, "
+      "%" PRIu64 " repeated", nr_capture, nr_skip, nr_dup));
+  printf("\n");
 }
 
 void init_vga() {
@@ -86,7 +299,16 @@ void init_vga() {
 #endif
 
   vmem = new_space(screen_size());
-  add_mmio_map("vmem", CONFIG_FB_ADDR, vmem, screen_size(), NULL);
+  nr_dirty = (screen_size() + MMIO_DIRTY_GRAIN - 1) >> MMIO_DIRTY_SHIFT;
+  vmem_dirty = malloc(nr_dirty);
+  assert(vmem_dirty);
+  // the first sync draws the whole screen
+  memset(vmem_dirty, 1, nr_dirty);
+  add_mmio_mem("vmem", CONFIG_FB_ADDR, vmem, screen_size(), vmem_dirty);
+  snapshot_add("vga.dirty", vmem_dirty, nr_dirty, vga_sync);
   IFDEF(CONFIG_VGA_SHOW_SCREEN, init_screen());
-  IFDEF(CONFIG_VGA_SHOW_SCREEN, memset(vmem, 0, screen_size()));
+#if defined(CONFIG_VGA_SHOW_SCREEN) || defined(CONFIG_VGA_CAPTURE)
+  memset(vmem, 0, screen_size());
+#endif
+  IFDEF(CONFIG_VGA_CAPTURE, init_capture());
 }
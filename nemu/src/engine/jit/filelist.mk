@@ -0,0 +1,22 @@
+#***************************************************************************************
+# Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+#
+# NEMU is licensed under Mulan PSL v2.
+# You can use this software according to the terms and conditions of the Mulan PSL v2.
+# You may obtain a copy of Mulan PSL v2 at:
+#          http://license.coscl.org.cn/MulanPSL2
+#
+# THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+# EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+# MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+#
+# See the Mulan PSL v2 for more details.
+#**************************************************************************************/
+
+# The JIT engine shares the host calls and the entry with the interpreter.
+SRCS-$(CONFIG_ENGINE_JIT) += src/engine/interpreter/hostcall.c src/engine/interpreter/init.c
+
+ifdef CONFIG_JIT_LLVM
+INC_PATH += $(shell llvm-config --includedir)
+LIBS += $(shell llvm-config --libs)
+endif
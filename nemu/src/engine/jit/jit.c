@@ -0,0 +1,258 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <cpu/cpu.h>
+#include <cpu/decode.h>
+#include <cpu/jit.h>
+#include <sys/mman.h>
+
+#if !defined(__x86_64__)
+#error "the JIT engine only supports x86-64 hosts"
+#endif
+
+#define JIT_HASH_SIZE 65536
+#define JIT_CODE_SIZE (32 * 1024 * 1024)
+#define JIT_BLOCK_MAX 65536
+// the max number of instructions run without returning to the dispatcher,
+// so that devices and watchpoints are checked in time
+#define JIT_SLICE 65536
+#define NR_PAGE (CONFIG_MSIZE >> PAGE_SHIFT)
+
+int64_t jit_budget = 0;
+bool jit_stop = false;
+uint8_t jit_code_page[NR_PAGE] = {};
+uint8_t *jit_exit = NULL;
+
+static JitBlock *hash[JIT_HASH_SIZE] = {};
+static JitBlock *page_list[NR_PAGE] = {};
+static JitBlock blocks[JIT_BLOCK_MAX];
+static int nr_block = 0;
+static uint8_t *code = NULL;
+static uint8_t *code_start = NULL; // after the trampoline
+static uint8_t *code_p = NULL;
+static uint64_t nr_translate = 0, nr_flush = 0, nr_interp = 0;
+
+typedef JitBlock* (*jit_enter_t)(CPU_state *cpu, int64_t *budget,
+    uint8_t *pmem, uint8_t *code_page, const void *code);
+static jit_enter_t jit_enter = NULL;
+
+static inline uint32_t hash_idx(vaddr_t pc) {
+  return (pc >> 2) & (JIT_HASH_SIZE - 1);
+}
+
+static inline uint32_t page_idx(vaddr_t pc) {
+  return (pc - CONFIG_MBASE) >> PAGE_SHIFT;
+}
+
+static void init_code_cache() {
+  code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  Assert(code != MAP_FAILED, "fail to allocate the code cache of the JIT");
+
+  // the entry trampoline saves the callee-saved registers and keeps rsp
+  // 16-byte aligned for the helper calls
+  uint8_t *p = code;
+  static const uint8_t enter[] = {
+    0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57, // push rbx, rbp, r12-r15
+    0x48, 0x83, 0xec, 0x08, // sub rsp, 8
+    0x48, 0x89, 0xfb,       // mov rbx, rdi
+    0x49, 0x89, 0xf4,       // mov r12, rsi
+    0x49, 0x89, 0xd5,       // mov r13, rdx
+    0x49, 0x89, 0xce,       // mov r14, rcx
+    0x41, 0xff, 0xe0,       // jmp r8
+  };
+  static const uint8_t exit[] = {
+    0x48, 0x83, 0xc4, 0x08, // add rsp, 8
+    0x41, 0x5f, 0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c, 0x5d, 0x5b, // pop r15-r12, rbp, rbx
+    0xc3,                   // ret
+  };
+  memcpy(p, enter, sizeof(enter));
+  jit_enter = (jit_enter_t)p;
+  p += sizeof(enter);
+  memcpy(p, exit, sizeof(exit));
+  jit_exit = p;
+  p += sizeof(exit);
+  code_start = code_p = (uint8_t *)ROUNDUP(p, 16);
+}
+
+static void flush_all() {
+  memset(hash, 0, sizeof(hash));
+  memset(page_list, 0, sizeof(page_list));
+  memset(jit_code_page, 0, sizeof(jit_code_page));
+  nr_block = 0;
+  code_p = code_start;
+  nr_flush ++;
+  IFDEF(CONFIG_JIT_LLVM, jit_llvm_flush());
+}
+
+static JitBlock* lookup(vaddr_t pc) {
+  JitBlock *b;
+  for (b = hash[hash_idx(pc)]; b != NULL; b = b->hash_next) {
+    if (b->pc == pc) return b;
+  }
+  return NULL;
+}
+
+static void unlink_hash(JitBlock *b) {
+  JitBlock **p;
+  for (p = &hash[hash_idx(b->pc)]; *p != NULL; p = &(*p)->hash_next) {
+    if (*p == b) { *p = b->hash_next; return; }
+  }
+}
+
+static JitBlock* translate(vaddr_t pc) {
+  uint8_t *end = NULL;
+  int retry;
+  for (retry = 0; retry < 2; retry ++) {
+    if (nr_block < JIT_BLOCK_MAX) {
+      JitBlock *b = &blocks[nr_block];
+      b->pc = pc;
+      b->chain = NULL;
+      b->count = NULL;
+      b->opt = NULL;
+      end = isa_jit_translate(b, code_p, code + JIT_CODE_SIZE);
+      if (end != NULL) break;
+    }
+    // blocks are never freed one by one, start over when the cache is full
+    flush_all();
+  }
+  Assert(end != NULL, "fail to translate the block at " FMT_WORD, pc);
+
+  JitBlock *b = &blocks[nr_block ++];
+  code_p = (uint8_t *)ROUNDUP(end, 16);
+  nr_translate ++;
+
+  b->hash_next = hash[hash_idx(pc)];
+  hash[hash_idx(pc)] = b;
+  uint32_t page = page_idx(pc);
+  b->page_next = page_list[page];
+  page_list[page] = b;
+  jit_code_page[page] = 1;
+  return b;
+}
+
+void jit_invalidate_page(uint32_t page, paddr_t addr, int len) {
+  JitBlock **p = &page_list[page];
+  while (*p != NULL) {
+    JitBlock *b = *p;
+    if (addr < b->end && addr + len > b->pc) {
+      unlink_hash(b);
+      *p = b->page_next;
+      // blocks chained to `b` still jump to its entry, let them exit
+      uint8_t *entry = b->code;
+      jit_emit_jmp(&entry, b->inval);
+      // the running block may be the dropped one
+      jit_stop = true;
+    } else {
+      p = &b->page_next;
+    }
+  }
+  if (page_list[page] == NULL) jit_code_page[page] = 0;
+}
+
+// run the instruction at `pc` with the interpreter, return true if the
+// host code should not continue with the next instruction
+bool jit_interp(vaddr_t pc) {
+  Decode s;
+  s.pc = pc;
+  s.snpc = pc;
+  isa_exec_once(&s);
+  cpu.pc = s.dnpc;
+  nr_interp ++;
+  return nemu_state.state != NEMU_RUNNING || cpu.pc != s.snpc || jit_stop;
+}
+
+word_t jit_load(vaddr_t addr, int len) {
+  return vaddr_read(addr, len);
+}
+
+bool jit_store(vaddr_t addr, int len, word_t data) {
+  vaddr_write(addr, len, data);
+  return nemu_state.state != NEMU_RUNNING || jit_stop;
+}
+
+#ifdef CONFIG_JIT_LLVM
+// run the optimized code of `b`, then go on with the successors which are
+// also optimized without returning to the dispatcher, at most `n` instructions
+static uint64_t run_opt(JitBlock *b, uint64_t n) {
+  uint64_t budget = (n < JIT_SLICE ? n : JIT_SLICE);
+  uint64_t nr = 0;
+  while (true) {
+    nr += b->opt(&cpu, guest_to_host(CONFIG_MBASE), jit_code_page);
+    if (jit_stop || nemu_state.state != NEMU_RUNNING || !in_pmem(cpu.pc)) break;
+    // dropped blocks are no longer in the hash table
+    b = lookup(cpu.pc);
+    if (b == NULL || b->opt == NULL || nr + b->nr_inst > budget) break;
+  }
+  return nr;
+}
+#endif
+
+// run at most `n` instructions from `cpu.pc`, return the number of
+// instructions actually run
+uint64_t jit_exec(uint64_t n) {
+  if (code == NULL) init_code_cache();
+
+  JitBlock *b = NULL;
+  if (likely(in_pmem(cpu.pc))) {
+    b = lookup(cpu.pc);
+    if (b == NULL) b = translate(cpu.pc);
+  }
+  if (b == NULL || b->nr_inst > n) {
+    // not enough budget for the whole block, or the block is not in pmem
+    jit_interp(cpu.pc);
+    return 1;
+  }
+
+  jit_stop = false;
+#ifdef CONFIG_JIT_LLVM
+  if (b->opt != NULL) return run_opt(b, n);
+#endif
+
+  int64_t budget = (n < JIT_SLICE ? n : JIT_SLICE);
+  jit_budget = budget;
+  JitBlock *from = jit_enter(&cpu, &jit_budget, guest_to_host(CONFIG_MBASE), jit_code_page, b->code);
+
+#ifdef CONFIG_JIT_LLVM
+  if ((uintptr_t)from & JIT_HOT) {
+    // the block is run by the optimized code from now on, let the blocks
+    // chained to it exit to the dispatcher
+    JitBlock *hot = (JitBlock *)((uintptr_t)from & ~(uintptr_t)JIT_HOT);
+    hot->opt = jit_llvm_compile(hot);
+    uint8_t *entry = hot->code;
+    jit_emit_jmp(&entry, hot->inval);
+    from = NULL;
+  }
+#endif
+
+  // chain the block which exits to its successor in pmem
+  if (from != NULL && !jit_stop && nemu_state.state == NEMU_RUNNING && in_pmem(cpu.pc)) {
+    JitBlock *to = lookup(cpu.pc);
+    if (to == NULL) {
+      uint64_t old_flush = nr_flush;
+      to = translate(cpu.pc);
+      // `from` is gone if the cache was flushed
+      if (nr_flush != old_flush) from = NULL;
+    }
+    if (from != NULL) jit_patch_rel32(from->chain, to->code);
+  }
+  return budget - jit_budget;
+}
+
+void jit_statistic() {
+  Log("jit: %" PRIu64 " blocks translated, %" PRIu64 " flushes, "
+      "%" PRIu64 " instructions interpreted", nr_translate, nr_flush, nr_interp);
+  IFDEF(CONFIG_JIT_LLVM, jit_llvm_statistic());
+}
@@ -0,0 +1,88 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <cpu/jit.h>
+
+#ifdef CONFIG_JIT_LLVM
+#include <llvm-c/Analysis.h>
+#include <llvm-c/LLJIT.h>
+#include <llvm-c/Target.h>
+#include <llvm-c/Transforms/PassBuilder.h>
+
+static LLVMOrcLLJITRef lljit = NULL;
+// owns the code of all compiled blocks, which is dropped when the code
+// cache of the JIT is flushed
+static LLVMOrcResourceTrackerRef tracker = NULL;
+static uint64_t nr_compile = 0;
+static uint64_t compile_time = 0; // unit: us
+
+static void check(LLVMErrorRef err, const char *what) {
+  if (err != NULL) {
+    char *msg = LLVMGetErrorMessage(err);
+    panic("LLVM fails to %s: %s", what, msg);
+  }
+}
+
+static void init_llvm() {
+  LLVMInitializeNativeTarget();
+  LLVMInitializeNativeAsmPrinter();
+  check(LLVMOrcCreateLLJIT(&lljit, NULL), "create LLJIT");
+  tracker = LLVMOrcJITDylibCreateResourceTracker(LLVMOrcLLJITGetMainJITDylib(lljit));
+}
+
+void jit_llvm_flush() {
+  if (lljit == NULL) return;
+  check(LLVMOrcResourceTrackerRemove(tracker), "remove the compiled code");
+  LLVMOrcReleaseResourceTracker(tracker);
+  tracker = LLVMOrcJITDylibCreateResourceTracker(LLVMOrcLLJITGetMainJITDylib(lljit));
+}
+
+jit_opt_t jit_llvm_compile(JitBlock *b) {
+  if (lljit == NULL) init_llvm();
+  uint64_t start = get_time();
+
+  LLVMOrcThreadSafeContextRef tsctx = LLVMOrcCreateNewThreadSafeContext();
+  LLVMContextRef ctx = LLVMOrcThreadSafeContextGetContext(tsctx);
+  char name[32];
+  snprintf(name, sizeof(name), "block_%" PRIu64, nr_compile);
+  LLVMModuleRef m = LLVMModuleCreateWithNameInContext(name, ctx);
+  LLVMSetTarget(m, LLVMOrcLLJITGetTripleString(lljit));
+  LLVMSetDataLayout(m, LLVMOrcLLJITGetDataLayoutStr(lljit));
+
+  isa_jit_lift(b, m, name);
+#ifdef CONFIG_RT_CHECK
+  Assert(!LLVMVerifyModule(m, LLVMPrintMessageAction, NULL),
+      "invalid IR for the block at " FMT_WORD, b->pc);
+#endif
+
+  LLVMPassBuilderOptionsRef opt = LLVMCreatePassBuilderOptions();
+  check(LLVMRunPasses(m, "default<O2>", NULL, opt), "optimize the IR");
+  LLVMDisposePassBuilderOptions(opt);
+
+  LLVMOrcThreadSafeModuleRef tsm = LLVMOrcCreateNewThreadSafeModule(m, tsctx);
+  LLVMOrcDisposeThreadSafeContext(tsctx);
+  check(LLVMOrcLLJITAddLLVMIRModuleWithRT(lljit, tracker, tsm), "add the module");
+  LLVMOrcExecutorAddress addr = 0;
+  check(LLVMOrcLLJITLookup(lljit, &addr, name), "compile the block");
+
+  nr_compile ++;
+  compile_time += get_time() - start;
+  return (jit_opt_t)(uintptr_t)addr;
+}
+
+void jit_llvm_statistic() {
+  Log("jit: %" PRIu64 " blocks optimized by LLVM in %" PRIu64 " us", nr_compile, compile_time);
+}
+#endif
@@ -0,0 +1,135 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <cpu/tblock.h>
+
+#define TBLOCK_HASH_SIZE 65536
+#define TBLOCK_ARENA_SIZE (16 * 1024 * 1024)
+#define NR_PAGE (CONFIG_MSIZE >> PAGE_SHIFT)
+
+bool tblock_stop = false;
+uint8_t tblock_code_page[NR_PAGE] = {};
+
+static TBlock *hash[TBLOCK_HASH_SIZE] = {};
+static TBlock *page_list[NR_PAGE] = {};
+static uint8_t *arena = NULL;
+static uint8_t *arena_p = NULL;
+static TBlock *running = NULL;
+
+static inline uint32_t hash_idx(vaddr_t pc) {
+  return (pc >> 2) & (TBLOCK_HASH_SIZE - 1);
+}
+
+static inline uint32_t page_idx(vaddr_t pc) {
+  return (pc - CONFIG_MBASE) >> PAGE_SHIFT;
+}
+
+static void flush_all() {
+  memset(hash, 0, sizeof(hash));
+  memset(page_list, 0, sizeof(page_list));
+  memset(tblock_code_page, 0, sizeof(tblock_code_page));
+  arena_p = arena;
+}
+
+static TBlock* lookup(vaddr_t pc) {
+  TBlock *tb;
+  for (tb = hash[hash_idx(pc)]; tb != NULL; tb = tb->hash_next) {
+    if (tb->pc == pc) return tb;
+  }
+  return NULL;
+}
+
+static void unlink_hash(TBlock *tb) {
+  TBlock **p;
+  for (p = &hash[hash_idx(tb->pc)]; *p != NULL; p = &(*p)->hash_next) {
+    if (*p == tb) { *p = tb->hash_next; return; }
+  }
+}
+
+static void translate_inst(TBlock *tb, vaddr_t pc, uint32_t max) {
+  tb->pc = pc;
+  uint32_t n = 0;
+  bool end = false;
+  while (!end) {
+    end = isa_tinst_translate(&tb->inst[n], pc);
+    pc = tb->inst[n].s.snpc;
+    n ++;
+    // do not cross the page boundary
+    end = end || n == max || (pc & PAGE_MASK) == 0;
+  }
+  tb->nr_inst = n;
+}
+
+static TBlock* translate(vaddr_t pc) {
+  size_t max_size = sizeof(TBlock) + sizeof(TInst) * TBLOCK_MAX_INST;
+  if (arena == NULL) {
+    arena = malloc(TBLOCK_ARENA_SIZE);
+    assert(arena);
+    arena_p = arena;
+  }
+  // blocks are never freed one by one, start over when the arena is full
+  if (arena_p + max_size > arena + TBLOCK_ARENA_SIZE) flush_all();
+
+  TBlock *tb = (TBlock *)arena_p;
+  translate_inst(tb, pc, TBLOCK_MAX_INST);
+  arena_p += ROUNDUP(sizeof(TBlock) + sizeof(TInst) * tb->nr_inst, sizeof(void *));
+
+  tb->hash_next = hash[hash_idx(tb->pc)];
+  hash[hash_idx(tb->pc)] = tb;
+  uint32_t page = page_idx(tb->pc);
+  tb->page_next = page_list[page];
+  page_list[page] = tb;
+  tblock_code_page[page] = 1;
+  return tb;
+}
+
+void tblock_invalidate_page(uint32_t page, paddr_t addr, int len) {
+  TBlock **p = &page_list[page];
+  while (*p != NULL) {
+    TBlock *tb = *p;
+    vaddr_t end = tb->inst[tb->nr_inst - 1].s.snpc;
+    if (addr < end && addr + len > tb->pc) {
+      unlink_hash(tb);
+      *p = tb->page_next;
+      if (tb == running) tblock_stop = true;
+    } else {
+      p = &tb->page_next;
+    }
+  }
+  if (page_list[page] == NULL) tblock_code_page[page] = 0;
+}
+
+// run at most `n` instructions from `cpu.pc`, return the number of
+// instructions actually run
+uint64_t tblock_exec(uint64_t n) {
+  TBlock *tb;
+  if (likely(in_pmem(cpu.pc))) {
+    tb = lookup(cpu.pc);
+    if (tb == NULL) tb = translate(cpu.pc);
+  } else {
+    // Only instructions in pmem are watched for modification, so the ones
+    // outside, e.g. in memory regions, are translated again and run one
+    // at a time.
+    static uint8_t once[sizeof(TBlock) + sizeof(TInst)] __attribute__((aligned(16)));
+    tb = (TBlock *)once;
+    translate_inst(tb, cpu.pc, 1);
+  }
+  uint32_t nr = (n < tb->nr_inst ? n : tb->nr_inst);
+  running = tb;
+  tblock_stop = false;
+  nr = isa_tblock_exec(tb, nr);
+  running = NULL;
+  return nr;
+}
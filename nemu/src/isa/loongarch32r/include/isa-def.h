@@ -30,6 +30,9 @@ typedef struct {
   } inst;
 } loongarch32r_ISADecodeInfo;
 
+// the leading 10 bits of the opcode select the bucket in the decode tree
+#define INSTPAT_BUCKET_MASK 0xffc00000
+
 #define isa_mmu_check(vaddr, len, type) (MMU_DIRECT)
 
 #endif
@@ -31,6 +31,9 @@ typedef struct {
   } inst;
 } mips32_ISADecodeInfo;
 
+// opcode and funct select the bucket in the decode tree
+#define INSTPAT_BUCKET_MASK 0xfc00003f
+
 #define isa_mmu_check(vaddr, len, type) (MMU_DIRECT)
 
 #endif
@@ -21,6 +21,10 @@
 typedef struct {
   word_t gpr[MUXDEF(CONFIG_RVE, 16, 32)];
   vaddr_t pc;
+  // the reservation of lr.w, sc.w only succeeds if the word is unchanged
+  vaddr_t reserve_addr;
+  word_t reserve_val;
+  bool reserve_valid;
 } MUXDEF(CONFIG_RV64, riscv64_CPU_state, riscv32_CPU_state);
 
 // decode
@@ -30,6 +34,9 @@ typedef struct {
   } inst;
 } MUXDEF(CONFIG_RV64, riscv64_ISADecodeInfo, riscv32_ISADecodeInfo);
 
+// opcode and funct3 select the bucket in the decode tree
+#define INSTPAT_BUCKET_MASK 0x707f
+
 #define isa_mmu_check(vaddr, len, type) (MMU_DIRECT)
 
 #endif
@@ -32,6 +32,14 @@ static void restart() {
 
     /* The zero register is always 0. */
     cpu.gpr[0] = 0;
+
+#if NR_HART > 1
+    /* Every hart starts with its hart ID in $a0. */
+    for (int i = 0; i < NR_HART; i++) {
+        hart[i] = cpu;
+        hart[i].gpr[10] = i;
+    }
+#endif
 }
 
 void init_isa() {
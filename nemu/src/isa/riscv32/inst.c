@@ -15,14 +15,17 @@
 
 #include "local-include/reg.h"
 #include <cpu/cpu.h>
+#include <cpu/dcache.h>
 #include <cpu/decode.h>
 #include <cpu/ifetch.h>
+#include <cpu/tblock.h>
 
 #define R(i) gpr(i)
 #define Mr vaddr_read
 #define Mw vaddr_write
 
 enum {
+    TYPE_R,
     TYPE_I,
     TYPE_U,
     TYPE_S,
@@ -31,11 +34,13 @@ enum {
 
 #define src1R()                                                                \
     do {                                                                       \
-        *src1 = R(rs1);                                                        \
+        *rs1 = BITS(i, 19, 15);                                                \
+        *src1 = R(*rs1);                                                       \
     } while (0)
 #define src2R()                                                                \
     do {                                                                       \
-        *src2 = R(rs2);                                                        \
+        *rs2 = BITS(i, 24, 20);                                                \
+        *src2 = R(*rs2);                                                       \
     } while (0)
 #define immI()                                                                 \
     do {                                                                       \
@@ -50,13 +55,16 @@ enum {
         *imm = (SEXT(BITS(i, 31, 25), 7) << 5) | BITS(i, 11, 7);               \
     } while (0)
 
-static void decode_operand(Decode *s, int *rd, word_t *src1, word_t *src2,
-                           word_t *imm, int type) {
+// `rs1` and `rs2` are only set when the corresponding source is read
+static void decode_operand(Decode *s, int *rd, int *rs1, int *rs2, word_t *src1,
+                           word_t *src2, word_t *imm, int type) {
     uint32_t i = s->isa.inst.val;
-    int rs1 = BITS(i, 19, 15);
-    int rs2 = BITS(i, 24, 20);
     *rd = BITS(i, 11, 7);
     switch (type) {
+    case TYPE_R:
+        src1R();
+        src2R();
+        break;
     case TYPE_I:
         src1R();
         immI();
@@ -72,15 +80,87 @@ static void decode_operand(Decode *s, int *rd, word_t *src1, word_t *src2,
     }
 }
 
-static int decode_exec(Decode *s) {
-    int rd = 0;
+static word_t amo_swap(word_t old, word_t src) { return src; }
+static word_t amo_add(word_t old, word_t src) { return old + src; }
+static word_t amo_xor(word_t old, word_t src) { return old ^ src; }
+static word_t amo_and(word_t old, word_t src) { return old & src; }
+static word_t amo_or(word_t old, word_t src) { return old | src; }
+static word_t amo_min(word_t old, word_t src) {
+    return (sword_t)old < (sword_t)src ? old : src;
+}
+static word_t amo_max(word_t old, word_t src) {
+    return (sword_t)old > (sword_t)src ? old : src;
+}
+static word_t amo_minu(word_t old, word_t src) { return old < src ? old : src; }
+static word_t amo_maxu(word_t old, word_t src) { return old > src ? old : src; }
+
+static word_t load_reserved(vaddr_t addr) {
+    word_t val = Mr(addr, 4);
+    cpu.reserve_addr = addr;
+    cpu.reserve_val = val;
+    cpu.reserve_valid = true;
+    return val;
+}
+
+// return 0 on success
+static word_t store_conditional(vaddr_t addr, word_t data) {
+    bool ok = cpu.reserve_valid && cpu.reserve_addr == addr &&
+              vaddr_cmpxchg(addr, cpu.reserve_val, data);
+    cpu.reserve_valid = false;
+    return !ok;
+}
+
+#ifdef CONFIG_ENGINE_THREADED
+// Translate the instruction in `s` into `t` when `n == 0`. Otherwise run
+// `n` pre-decoded instructions starting from `t`, by jumping from the end of
+// one execution body directly to the next one.
+static uint32_t decode_exec(Decode *s, TInst *t, uint32_t n) {
+    int rd = 0, rs1 = 0, rs2 = 0;
+    word_t src1 = 0, src2 = 0, imm = 0;
+    TInst *t_start = t, *t_end = t + n;
+
+    if (n > 0) {
+        goto dispatch;
+    }
+#define EXEC_LABEL(s, name)                                                    \
+    if (n == 0) {                                                              \
+        t->handler = &&concat(__exec_, name);                                  \
+        t->rd = rd;                                                            \
+        t->rs1 = rs1;                                                          \
+        t->rs2 = rs2;                                                          \
+        t->imm = imm;                                                          \
+        goto *(__instpat_end);                                                 \
+    }                                                                          \
+    concat(__exec_, name) :
+#else
+static int decode_exec(Decode *s, const DecodeCacheEntry *e) {
+    int rd = 0, rs1 = 0, rs2 = 0;
     word_t src1 = 0, src2 = 0, imm = 0;
     s->dnpc = s->snpc;
 
+#ifdef CONFIG_DCACHE
+    if (e != NULL) {
+        rd = e->rd;
+        src1 = R(e->rs1);
+        src2 = R(e->rs2);
+        imm = e->imm;
+        goto *e->handler;
+    }
+#define EXEC_LABEL(s, name)                                                    \
+    dcache_fill(s->pc, s->isa.inst.val, &&concat(__exec_, name), rd, rs1, rs2, \
+                imm);                                                          \
+    concat(__exec_, name) :
+#else
+#define EXEC_LABEL(s, name)
+#endif
+#endif
+
 #define INSTPAT_INST(s) ((s)->isa.inst.val)
 #define INSTPAT_MATCH(s, name, type, ... /* execute body */)                   \
     {                                                                          \
-        decode_operand(s, &rd, &src1, &src2, &imm, concat(TYPE_, type));       \
+        decode_operand(s, &rd, &rs1, &rs2, &src1, &src2, &imm,                 \
+                       concat(TYPE_, type));                                   \
+        EXEC_LABEL(s, name);                                                  \
         __VA_ARGS__;                                                           \
     }
 
@@ -91,6 +171,34 @@ static int decode_exec(Decode *s) {
             R(rd) = Mr(src1 + imm, 1));
     INSTPAT("??????? ????? ????? 000 ????? 01000 11", sb, S,
             Mw(src1 + imm, 1, src2));
+    INSTPAT("????? ?? ????? ????? 000 ????? 00011 11", fence, N,
+            __atomic_thread_fence(__ATOMIC_SEQ_CST));
+    INSTPAT("????? ?? ????? ????? 001 ????? 00011 11", fence_i, N,
+            dcache_flush());
+    INSTPAT("00010 ?? 00000 ????? 010 ????? 01011 11", lr_w, R,
+            R(rd) = load_reserved(src1));
+    INSTPAT("00011 ?? ????? ????? 010 ????? 01011 11", sc_w, R,
+            R(rd) = store_conditional(src1, src2));
+    INSTPAT("00001 ?? ????? ????? 010 ????? 01011 11", amoswap_w, R,
+            R(rd) = vaddr_amo(src1, amo_swap, src2));
+    INSTPAT("00000 ?? ????? ????? 010 ????? 01011 11", amoadd_w, R,
+            R(rd) = vaddr_amo(src1, amo_add, src2));
+    INSTPAT("00100 ?? ????? ????? 010 ????? 01011 11", amoxor_w, R,
+            R(rd) = vaddr_amo(src1, amo_xor, src2));
+    INSTPAT("01100 ?? ????? ????? 010 ????? 01011 11", amoand_w, R,
+            R(rd) = vaddr_amo(src1, amo_and, src2));
+    INSTPAT("01000 ?? ????? ????? 010 ????? 01011 11", amoor_w, R,
+            R(rd) = vaddr_amo(src1, amo_or, src2));
+    INSTPAT("10000 ?? ????? ????? 010 ????? 01011 11", amomin_w, R,
+            R(rd) = vaddr_amo(src1, amo_min, src2));
+    INSTPAT("10100 ?? ????? ????? 010 ????? 01011 11", amomax_w, R,
+            R(rd) = vaddr_amo(src1, amo_max, src2));
+    INSTPAT("11000 ?? ????? ????? 010 ????? 01011 11", amominu_w, R,
+            R(rd) = vaddr_amo(src1, amo_minu, src2));
+    INSTPAT("11100 ?? ????? ????? 010 ????? 01011 11", amomaxu_w, R,
+            R(rd) = vaddr_amo(src1, amo_maxu, src2));
+    INSTPAT("0001001 ????? ????? 000 00000 11100 11", sfence_vma, N,
+            tlb_flush());
     INSTPAT("0000000 00001 00000 000 00000 11100 11", ebreak, N,
             NEMUTRAP(s->pc, R(10))); // R(10) is $a0
     INSTPAT("??????? ????? ????? ??? ????? ????? ??", inv, N, INV(s->pc));
@@ -98,11 +206,62 @@ static int decode_exec(Decode *s) {
 
     R(0) = 0; // reset $zero to 0
 
+#ifdef CONFIG_ENGINE_THREADED
+    if (n == 0) {
+        return 0;
+    }
+    t++;
+    if (t != t_end && nemu_state.state == NEMU_RUNNING && !tblock_stop) {
+    dispatch:
+        s = &t->s;
+        s->dnpc = s->snpc;
+        rd = t->rd;
+        src1 = R(t->rs1);
+        src2 = R(t->rs2);
+        imm = t->imm;
+        goto *t->handler;
+    }
+    cpu.pc = s->dnpc;
+    return t - t_start;
+#else
     return 0;
+#endif
 }
 
+#ifdef CONFIG_ENGINE_THREADED
+// return true if `t` ends a translation block
+bool isa_tinst_translate(TInst *t, vaddr_t pc) {
+    Decode *s = &t->s;
+    s->pc = pc;
+    s->snpc = pc;
+    s->isa.inst.val = inst_fetch(&s->snpc, 4);
+    decode_exec(s, t, 0);
+    // branch, jalr, jal and system instructions may change the control flow
+    switch (BITS(s->isa.inst.val, 6, 0)) {
+    case 0x63:
+    case 0x67:
+    case 0x6f:
+    case 0x73:
+        return true;
+    }
+    return false;
+}
+
+uint32_t isa_tblock_exec(TBlock *tb, uint32_t n) {
+    return decode_exec(NULL, tb->inst, n);
+}
+#else
 int isa_exec_once(Decode *s) {
+#ifdef CONFIG_DCACHE
+    const DecodeCacheEntry *e = dcache_lookup(s->pc);
+    if (likely(e != NULL)) {
+        s->snpc += 4;
+        s->isa.inst.val = e->inst;
+        return decode_exec(s, e);
+    }
+#endif
     // 保存命令地址
     s->isa.inst.val = inst_fetch(&s->snpc, 4);
-    return decode_exec(s);
+    return decode_exec(s, NULL);
 }
+#endif
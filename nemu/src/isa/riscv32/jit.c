@@ -0,0 +1,434 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <isa.h>
+#include <cpu/ifetch.h>
+#include <cpu/jit.h>
+#include <stddef.h>
+
+#ifdef CONFIG_ENGINE_JIT
+
+#define JIT_MAX_INST 64
+// enough for the host code of any block
+#define JIT_MAX_BLOCK_SIZE (JIT_MAX_INST * 128 + 128)
+
+#define GPR(i) (offsetof(CPU_state, gpr) + (i) * sizeof(word_t))
+#define PC offsetof(CPU_state, pc)
+
+// load the guest address `R(rs1) + imm` into eax, and its offset in pmem into ecx
+static void emit_addr(uint8_t **p, int rs1, word_t imm) {
+  if (rs1 == 0) jit_emit_mov_imm(p, RAX, imm);
+  else {
+    jit_emit_ld_cpu(p, RAX, GPR(rs1));
+    if (imm != 0) jit_emit_alu_imm(p, JIT_OP_ADD, RAX, imm);
+  }
+  jit_emit_mov(p, RCX, RAX);
+  jit_emit_alu_imm(p, JIT_OP_SUB, RCX, CONFIG_MBASE);
+}
+
+// exit from the middle of a block with `refund` instructions not run,
+// cpu.pc is set to `pc` unless the helper has already set it
+static void emit_early_exit(uint8_t **p, uint32_t refund, bool set_pc, vaddr_t pc) {
+  if (refund != 0) jit_emit_budget(p, JIT_OP_ADD, refund);
+  if (set_pc) jit_emit_st_cpu_imm(p, PC, pc);
+  jit_emit_mov_imm(p, RAX, 0);
+  jit_emit_jmp(p, jit_exit);
+}
+
+static void emit_load(uint8_t **p, int rd, int rs1, word_t imm, int len, bool sign) {
+  emit_addr(p, rs1, imm);
+  jit_emit_alu_imm(p, JIT_OP_CMP, RCX, CONFIG_MSIZE - len + 1);
+  uint8_t *slow = jit_emit_jcc(p, JIT_CC_AE, NULL);
+
+  // the fast path reads pmem directly: mov{zx,sx} eax, [r13 + rcx]
+  static const uint8_t op[3][2] = { { 0xb6, 0xbe }, { 0xb7, 0xbf }, { 0x8b, 0x8b } };
+  const uint8_t *o = op[len == 4 ? 2 : len - 1];
+  jit_emit8(p, 0x41);
+  if (len != 4) jit_emit8(p, 0x0f);
+  jit_emit8(p, o[sign]);
+  jit_emit8(p, 0x44); jit_emit8(p, 0x0d); jit_emit8(p, 0x00);
+  uint8_t *done = jit_emit_jmp(p, *p);
+
+  // the slow path goes through vaddr_read() for MMIO
+  jit_patch_rel32(slow, *p);
+  jit_emit_mov(p, RDI, RAX);
+  jit_emit_mov_imm(p, RSI, len);
+  jit_emit_call(p, jit_load);
+  if (sign && len != 4) {
+    jit_emit8(p, 0x0f); jit_emit8(p, len == 1 ? 0xbe : 0xbf); jit_emit8(p, 0xc0); // movsx eax, al/ax
+  }
+
+  jit_patch_rel32(done, *p);
+  if (rd != 0) jit_emit_st_cpu(p, RAX, GPR(rd));
+}
+
+static void emit_store(uint8_t **p, int rs1, int rs2, word_t imm, int len,
+    uint32_t refund, vaddr_t snpc) {
+  emit_addr(p, rs1, imm);
+  if (rs2 == 0) jit_emit_mov_imm(p, RDX, 0);
+  else jit_emit_ld_cpu(p, RDX, GPR(rs2));
+  jit_emit_alu_imm(p, JIT_OP_CMP, RCX, CONFIG_MSIZE - len + 1);
+  uint8_t *slow = jit_emit_jcc(p, JIT_CC_AE, NULL);
+  // pages with translated code also take the slow path to drop the blocks:
+  // mov esi, ecx; shr esi, 12; cmp byte [r14 + rsi], 0
+  jit_emit_mov(p, RSI, RCX);
+  jit_emit8(p, 0xc1); jit_emit8(p, 0xee); jit_emit8(p, PAGE_SHIFT);
+  jit_emit8(p, 0x41); jit_emit8(p, 0x80); jit_emit8(p, 0x3c); jit_emit8(p, 0x36); jit_emit8(p, 0x00);
+  uint8_t *slow2 = jit_emit_jcc(p, JIT_CC_NE, NULL);
+
+  // mov [r13 + rcx], dl/dx/edx
+  if (len == 2) jit_emit8(p, 0x66);
+  jit_emit8(p, 0x41);
+  jit_emit8(p, len == 1 ? 0x88 : 0x89);
+  jit_emit8(p, 0x54); jit_emit8(p, 0x0d); jit_emit8(p, 0x00);
+  uint8_t *done = jit_emit_jmp(p, *p);
+
+  jit_patch_rel32(slow, *p);
+  jit_patch_rel32(slow2, *p);
+  jit_emit_mov(p, RDI, RAX);
+  jit_emit_mov_imm(p, RSI, len);
+  jit_emit_call(p, jit_store);
+  jit_emit8(p, 0x84); jit_emit8(p, 0xc0); // test al, al
+  uint8_t *cont = jit_emit_jcc(p, JIT_CC_E, NULL);
+  emit_early_exit(p, refund, true, snpc);
+  jit_patch_rel32(cont, *p);
+
+  jit_patch_rel32(done, *p);
+}
+
+// run the instruction with the interpreter
+static void emit_interp(uint8_t **p, vaddr_t pc, uint32_t refund) {
+  jit_emit_mov_imm(p, RDI, pc);
+  jit_emit_call(p, jit_interp);
+  jit_emit8(p, 0x84); jit_emit8(p, 0xc0); // test al, al
+  uint8_t *cont = jit_emit_jcc(p, JIT_CC_E, NULL);
+  emit_early_exit(p, refund, false, 0);
+  jit_patch_rel32(cont, *p);
+}
+
+// the instructions handled by the translators, others are run by the interpreter
+enum { JIT_AUIPC, JIT_LBU, JIT_SB, JIT_INTERP };
+
+typedef struct {
+  int kind;
+  int rd, rs1, rs2;
+  word_t imm;
+} JitInst;
+
+static JitInst jit_decode(uint32_t i) {
+  JitInst d = { .kind = JIT_INTERP, .rd = BITS(i, 11, 7),
+    .rs1 = BITS(i, 19, 15), .rs2 = BITS(i, 24, 20) };
+  uint32_t funct3 = BITS(i, 14, 12);
+  switch (BITS(i, 6, 0)) {
+    case 0x17:
+      d.kind = JIT_AUIPC; d.imm = SEXT(BITS(i, 31, 12), 20) << 12;
+      break;
+    case 0x03:
+      if (funct3 == 4) { d.kind = JIT_LBU; d.imm = SEXT(BITS(i, 31, 20), 12); }
+      break;
+    case 0x23:
+      if (funct3 == 0) { d.kind = JIT_SB; d.imm = (SEXT(BITS(i, 31, 25), 7) << 5) | BITS(i, 11, 7); }
+      break;
+  }
+  return d;
+}
+
+// fetch the instructions of the block starting from `b->pc`, return the number
+static uint32_t fetch_block(JitBlock *b, uint32_t *inst) {
+  vaddr_t pc = b->pc;
+  uint32_t n = 0;
+  bool stop = false;
+  while (!stop) {
+    inst[n ++] = inst_fetch(&pc, 4);
+    // branch, jalr, jal and system instructions may change the control flow
+    switch (BITS(inst[n - 1], 6, 0)) {
+      case 0x63: case 0x67: case 0x6f: case 0x73: stop = true;
+    }
+    stop = stop || n == JIT_MAX_INST || (pc & PAGE_MASK) == 0;
+  }
+  b->end = pc;
+  return n;
+}
+
+uint8_t* isa_jit_translate(JitBlock *b, uint8_t *p, uint8_t *end) {
+  if (end - p < JIT_MAX_BLOCK_SIZE) return NULL;
+
+  // fetch the instructions first, the entry needs the number
+  uint32_t inst[JIT_MAX_INST];
+  uint32_t n = fetch_block(b, inst);
+  b->nr_inst = n;
+
+#ifdef CONFIG_JIT_LLVM
+  // the counter lives in the code cache to be addressed rip-relatively
+  b->count = (uint32_t *)p;
+  *b->count = 0;
+  p += 16;
+  b->code = p;
+  // inc dword [count]; cmp dword [count], JIT_HOT_THRESHOLD; je hot
+  jit_emit8(&p, 0xff); jit_emit8(&p, 0x05);
+  jit_patch_rel32(p, b->count); p += 4;
+  jit_emit8(&p, 0x81); jit_emit8(&p, 0x3d);
+  // rip points to the end of the instruction, after the imm32
+  jit_patch_rel32(p, (uint8_t *)b->count - 4); p += 4;
+  jit_emit32(&p, JIT_HOT_THRESHOLD);
+  uint8_t *hot = jit_emit_jcc(&p, JIT_CC_E, NULL);
+#else
+  b->code = p;
+#endif
+
+  // entry: sub qword [r12], n; jl undo
+  jit_emit_budget(&p, JIT_OP_SUB, n);
+  uint8_t *undo = jit_emit_jcc(&p, JIT_CC_L, NULL);
+
+  uint32_t k;
+  vaddr_t pc;
+  for (k = 0, pc = b->pc; k < n; k ++, pc += 4) {
+    JitInst d = jit_decode(inst[k]);
+    uint32_t refund = n - k - 1;
+    switch (d.kind) {
+      case JIT_AUIPC:
+        if (d.rd != 0) jit_emit_st_cpu_imm(&p, GPR(d.rd), pc + d.imm);
+        break;
+      case JIT_LBU: emit_load(&p, d.rd, d.rs1, d.imm, 1, false); break;
+      case JIT_SB: emit_store(&p, d.rs1, d.rs2, d.imm, 1, refund, pc + 4); break;
+      default: emit_interp(&p, pc, refund); break;
+    }
+  }
+
+  // fall through to the successor, the jump is patched when chaining
+  jit_emit_st_cpu_imm(&p, PC, b->end);
+  jit_emit8(&p, 0x48); jit_emit8(&p, 0xb8); jit_emit64(&p, (uintptr_t)b); // movabs rax, b
+  b->chain = jit_emit_jmp(&p, jit_exit);
+
+#ifdef CONFIG_JIT_LLVM
+  // exit with the tagged block to compile it
+  jit_patch_rel32(hot, p);
+  jit_emit_st_cpu_imm(&p, PC, b->pc);
+  jit_emit8(&p, 0x48); jit_emit8(&p, 0xb8); jit_emit64(&p, (uintptr_t)b | JIT_HOT);
+  jit_emit_jmp(&p, jit_exit);
+#endif
+
+  // not enough budget for the whole block
+  jit_patch_rel32(undo, p);
+  jit_emit_budget(&p, JIT_OP_ADD, n);
+  b->inval = p;
+  emit_early_exit(&p, 0, true, b->pc);
+  return p;
+}
+
+#ifdef CONFIG_JIT_LLVM
+// Lift a block to a function of type jit_opt_t. The guest registers used by
+// the block are kept in allocas, which are promoted to SSA values by LLVM.
+// They are written back to `cpu` before calling a helper and leaving the
+// function, and reloaded after calling a helper.
+typedef struct {
+  LLVMContextRef ctx;
+  LLVMBuilderRef bd;
+  LLVMValueRef fn, cpu, pmem, code_page;
+  LLVMTypeRef i8, i32, i64;
+  LLVMValueRef reg[32];
+  uint32_t used, dirty;
+} Lifter;
+
+static LLVMValueRef const32(Lifter *l, uint32_t x) { return LLVMConstInt(l->i32, x, false); }
+
+static LLVMValueRef cpu_field(Lifter *l, uint32_t offset) {
+  LLVMValueRef idx = const32(l, offset / sizeof(uint32_t));
+  return LLVMBuildInBoundsGEP2(l->bd, l->i32, l->cpu, &idx, 1, "");
+}
+
+static LLVMValueRef read_reg(Lifter *l, int r) {
+  return (r == 0 ? const32(l, 0) : LLVMBuildLoad2(l->bd, l->i32, l->reg[r], ""));
+}
+
+static void write_reg(Lifter *l, int r, LLVMValueRef v) {
+  if (r == 0) return;
+  LLVMBuildStore(l->bd, v, l->reg[r]);
+  l->dirty |= 1u << r;
+}
+
+static void sync_regs(Lifter *l) {
+  int r;
+  for (r = 1; r < 32; r ++) {
+    if (l->dirty & (1u << r)) {
+      LLVMBuildStore(l->bd, LLVMBuildLoad2(l->bd, l->i32, l->reg[r], ""), cpu_field(l, GPR(r)));
+    }
+  }
+}
+
+static void reload_regs(Lifter *l) {
+  int r;
+  for (r = 1; r < 32; r ++) {
+    if (l->used & (1u << r)) {
+      LLVMBuildStore(l->bd, LLVMBuildLoad2(l->bd, l->i32, cpu_field(l, GPR(r)), ""), l->reg[r]);
+    }
+  }
+  l->dirty = 0;
+}
+
+static LLVMValueRef call_helper(Lifter *l, const void *fn, LLVMTypeRef ret,
+    LLVMValueRef *args, int nr_arg) {
+  LLVMTypeRef arg_ty[3] = { l->i32, l->i32, l->i32 };
+  LLVMTypeRef ty = LLVMFunctionType(ret, arg_ty, nr_arg, false);
+  LLVMValueRef ptr = LLVMConstIntToPtr(LLVMConstInt(l->i64, (uintptr_t)fn, false),
+      LLVMPointerType(ty, 0));
+  return LLVMBuildCall2(l->bd, ty, ptr, args, nr_arg, "");
+}
+
+// leave with `nr` instructions run if `cond` holds, the helper has written
+// the registers back
+static void exit_if(Lifter *l, LLVMValueRef cond, uint32_t nr, bool set_pc, vaddr_t pc) {
+  LLVMBasicBlockRef exit = LLVMAppendBasicBlockInContext(l->ctx, l->fn, "");
+  LLVMBasicBlockRef cont = LLVMAppendBasicBlockInContext(l->ctx, l->fn, "");
+  LLVMBuildCondBr(l->bd, cond, exit, cont);
+  LLVMPositionBuilderAtEnd(l->bd, exit);
+  sync_regs(l);
+  if (set_pc) LLVMBuildStore(l->bd, const32(l, pc), cpu_field(l, PC));
+  LLVMBuildRet(l->bd, const32(l, nr));
+  LLVMPositionBuilderAtEnd(l->bd, cont);
+}
+
+static LLVMValueRef helper_failed(Lifter *l, LLVMValueRef ret) {
+  return LLVMBuildICmp(l->bd, LLVMIntNE, ret, LLVMConstInt(l->i8, 0, false), "");
+}
+
+static void lift_lbu(Lifter *l, JitInst *d) {
+  LLVMValueRef addr = LLVMBuildAdd(l->bd, read_reg(l, d->rs1), const32(l, d->imm), "");
+  LLVMValueRef off = LLVMBuildSub(l->bd, addr, const32(l, CONFIG_MBASE), "");
+  LLVMValueRef in = LLVMBuildICmp(l->bd, LLVMIntULT, off, const32(l, CONFIG_MSIZE), "");
+  LLVMBasicBlockRef fast = LLVMAppendBasicBlockInContext(l->ctx, l->fn, "");
+  LLVMBasicBlockRef slow = LLVMAppendBasicBlockInContext(l->ctx, l->fn, "");
+  LLVMBasicBlockRef join = LLVMAppendBasicBlockInContext(l->ctx, l->fn, "");
+  LLVMBuildCondBr(l->bd, in, fast, slow);
+
+  LLVMPositionBuilderAtEnd(l->bd, fast);
+  LLVMValueRef idx = LLVMBuildZExt(l->bd, off, l->i64, "");
+  LLVMValueRef host = LLVMBuildInBoundsGEP2(l->bd, l->i8, l->pmem, &idx, 1, "");
+  LLVMValueRef v_fast = LLVMBuildZExt(l->bd, LLVMBuildLoad2(l->bd, l->i8, host, ""), l->i32, "");
+  LLVMBuildBr(l->bd, join);
+
+  // MMIO may touch the registers, e.g. through difftest
+  LLVMPositionBuilderAtEnd(l->bd, slow);
+  uint32_t dirty = l->dirty;
+  sync_regs(l);
+  LLVMValueRef args[2] = { addr, const32(l, 1) };
+  LLVMValueRef v_slow = call_helper(l, jit_load, l->i32, args, 2);
+  reload_regs(l);
+  l->dirty = dirty;
+  LLVMBasicBlockRef slow_end = LLVMGetInsertBlock(l->bd);
+  LLVMBuildBr(l->bd, join);
+
+  LLVMPositionBuilderAtEnd(l->bd, join);
+  LLVMValueRef v = LLVMBuildPhi(l->bd, l->i32, "");
+  LLVMValueRef vals[2] = { v_fast, v_slow };
+  LLVMBasicBlockRef bbs[2] = { fast, slow_end };
+  LLVMAddIncoming(v, vals, bbs, 2);
+  write_reg(l, d->rd, v);
+}
+
+static void lift_sb(Lifter *l, JitInst *d, uint32_t nr, vaddr_t snpc) {
+  LLVMValueRef addr = LLVMBuildAdd(l->bd, read_reg(l, d->rs1), const32(l, d->imm), "");
+  LLVMValueRef data = read_reg(l, d->rs2);
+  LLVMValueRef off = LLVMBuildSub(l->bd, addr, const32(l, CONFIG_MBASE), "");
+  LLVMValueRef in = LLVMBuildICmp(l->bd, LLVMIntULT, off, const32(l, CONFIG_MSIZE), "");
+  LLVMBasicBlockRef check = LLVMAppendBasicBlockInContext(l->ctx, l->fn, "");
+  LLVMBasicBlockRef fast = LLVMAppendBasicBlockInContext(l->ctx, l->fn, "");
+  LLVMBasicBlockRef slow = LLVMAppendBasicBlockInContext(l->ctx, l->fn, "");
+  LLVMBasicBlockRef join = LLVMAppendBasicBlockInContext(l->ctx, l->fn, "");
+  LLVMBuildCondBr(l->bd, in, check, slow);
+
+  // pages with translated code take the slow path to drop the blocks
+  LLVMPositionBuilderAtEnd(l->bd, check);
+  LLVMValueRef page = LLVMBuildZExt(l->bd, LLVMBuildLShr(l->bd, off, const32(l, PAGE_SHIFT), ""), l->i64, "");
+  LLVMValueRef flag = LLVMBuildLoad2(l->bd, l->i8,
+      LLVMBuildInBoundsGEP2(l->bd, l->i8, l->code_page, &page, 1, ""), "");
+  LLVMBuildCondBr(l->bd, helper_failed(l, flag), slow, fast);
+
+  LLVMPositionBuilderAtEnd(l->bd, fast);
+  LLVMValueRef idx = LLVMBuildZExt(l->bd, off, l->i64, "");
+  LLVMValueRef host = LLVMBuildInBoundsGEP2(l->bd, l->i8, l->pmem, &idx, 1, "");
+  LLVMBuildStore(l->bd, LLVMBuildTrunc(l->bd, data, l->i8, ""), host);
+  LLVMBuildBr(l->bd, join);
+
+  LLVMPositionBuilderAtEnd(l->bd, slow);
+  uint32_t dirty = l->dirty;
+  sync_regs(l);
+  LLVMValueRef args[3] = { addr, const32(l, 1), data };
+  LLVMValueRef ret = call_helper(l, jit_store, l->i8, args, 3);
+  reload_regs(l);
+  exit_if(l, helper_failed(l, ret), nr, true, snpc);
+  l->dirty = dirty;
+  LLVMBuildBr(l->bd, join);
+
+  LLVMPositionBuilderAtEnd(l->bd, join);
+}
+
+static void lift_interp(Lifter *l, uint32_t nr, vaddr_t pc) {
+  sync_regs(l);
+  LLVMValueRef arg = const32(l, pc);
+  LLVMValueRef ret = call_helper(l, jit_interp, l->i8, &arg, 1);
+  reload_regs(l);
+  exit_if(l, helper_failed(l, ret), nr, false, 0);
+}
+
+void isa_jit_lift(JitBlock *b, LLVMModuleRef m, const char *name) {
+  uint32_t inst[JIT_MAX_INST];
+  uint32_t n = fetch_block(b, inst);
+  Assert(n == b->nr_inst, "the block at " FMT_WORD " is changed", b->pc);
+
+  Lifter l = { .ctx = LLVMGetModuleContext(m) };
+  l.i8 = LLVMInt8TypeInContext(l.ctx);
+  l.i32 = LLVMInt32TypeInContext(l.ctx);
+  l.i64 = LLVMInt64TypeInContext(l.ctx);
+  LLVMTypeRef arg_ty[3] = { LLVMPointerType(l.i32, 0), LLVMPointerType(l.i8, 0), LLVMPointerType(l.i8, 0) };
+  l.fn = LLVMAddFunction(m, name, LLVMFunctionType(l.i32, arg_ty, 3, false));
+  l.cpu = LLVMGetParam(l.fn, 0);
+  l.pmem = LLVMGetParam(l.fn, 1);
+  l.code_page = LLVMGetParam(l.fn, 2);
+  l.bd = LLVMCreateBuilderInContext(l.ctx);
+  LLVMPositionBuilderAtEnd(l.bd, LLVMAppendBasicBlockInContext(l.ctx, l.fn, "entry"));
+
+  JitInst d[JIT_MAX_INST];
+  uint32_t k;
+  for (k = 0; k < n; k ++) {
+    d[k] = jit_decode(inst[k]);
+    if (d[k].kind != JIT_INTERP) {
+      l.used |= (1u << d[k].rd) | (1u << d[k].rs1) | (d[k].kind == JIT_SB ? 1u << d[k].rs2 : 0);
+    }
+  }
+  l.used &= ~1u;
+  int r;
+  for (r = 1; r < 32; r ++) {
+    if (l.used & (1u << r)) l.reg[r] = LLVMBuildAlloca(l.bd, l.i32, "");
+  }
+  reload_regs(&l);
+
+  vaddr_t pc;
+  for (k = 0, pc = b->pc; k < n; k ++, pc += 4) {
+    switch (d[k].kind) {
+      case JIT_AUIPC: write_reg(&l, d[k].rd, const32(&l, pc + d[k].imm)); break;
+      case JIT_LBU: lift_lbu(&l, &d[k]); break;
+      case JIT_SB: lift_sb(&l, &d[k], k + 1, pc + 4); break;
+      default: lift_interp(&l, k + 1, pc); break;
+    }
+  }
+  sync_regs(&l);
+  LLVMBuildStore(l.bd, const32(&l, b->end), cpu_field(&l, PC));
+  LLVMBuildRet(l.bd, const32(&l, n));
+  LLVMDisposeBuilder(l.bd);
+}
+#endif
+
+#endif
@@ -0,0 +1,171 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+
+#include <isa.h>
+#include <memory/memprof.h>
+#include <utils.h>
+
+#ifdef CONFIG_MEMPROF
+// The profile written to CONFIG_MEMPROF_FILE is
+//   MemProfHeader
+//   MemProfPage[nr_page], for the touched pages in address order
+//   MemProfLine[nr_line], for the touched cache lines in address order
+//   MemProfWS[nr_ws], for each interval in time order
+// all in the byte order of the host.
+typedef struct {
+  char magic[8]; // "NEMUPROF"
+  uint32_t version;
+  uint32_t line_size;
+  uint64_t mbase, msize;
+  uint64_t interval; // instructions
+  uint64_t nr_page, nr_line, nr_ws;
+} MemProfHeader;
+
+typedef struct {
+  uint64_t addr;
+  uint64_t count[3]; // indexed by MEM_TYPE_*
+} MemProfPage;
+
+typedef struct {
+  uint64_t addr;
+  uint32_t count; // saturated at UINT32_MAX
+  uint32_t pad;
+} MemProfLine;
+
+typedef struct {
+  uint64_t nr_inst; // end of the interval
+  uint64_t nr_page; // pages touched in the interval
+} MemProfWS;
+
+uint64_t memprof_page[3][MEMPROF_NR_PAGE] = {};
+uint32_t memprof_line[MEMPROF_NR_LINE] = {};
+uint64_t memprof_ws[(MEMPROF_NR_PAGE + 63) / 64] = {};
+uint64_t memprof_ws_end = CONFIG_MEMPROF_INTERVAL;
+
+static MemProfWS *ws = NULL;
+static uint64_t nr_ws = 0;
+static uint64_t ws_cap = 0;
+
+static void ws_push(uint64_t nr_inst, uint64_t nr_page) {
+  if (nr_ws == ws_cap) {
+    ws_cap = (ws_cap == 0 ? 1024 : ws_cap * 2);
+    ws = realloc(ws, ws_cap * sizeof(*ws));
+    assert(ws);
+  }
+  ws[nr_ws ++] = (MemProfWS){ nr_inst, nr_page };
+}
+
+static uint64_t ws_count() {
+  uint64_t n = 0;
+  int i;
+  for (i = 0; i < ARRLEN(memprof_ws); i ++) n += __builtin_popcountll(memprof_ws[i]);
+  return n;
+}
+
+// Called on the first access after an interval ends. The pages are those
+// touched since the last record, which may span several intervals if the
+// guest did not access pmem for a while.
+void memprof_ws_close() {
+  ws_push(g_nr_guest_inst, ws_count());
+  memset(memprof_ws, 0, sizeof(memprof_ws));
+  memprof_ws_end = (g_nr_guest_inst / CONFIG_MEMPROF_INTERVAL + 1) * CONFIG_MEMPROF_INTERVAL;
+}
+
+static bool write_profile(const char *path, uint64_t nr_page, uint64_t nr_line,
+    uint64_t nr_ws_total, uint64_t last_ws) {
+  FILE *fp = fopen(path, "wb");
+  if (fp == NULL) return false;
+  MemProfHeader h = { .magic = "NEMUPROF", .version = 1,
+    .line_size = 1 << MEMPROF_LINE_SHIFT, .mbase = CONFIG_MBASE, .msize = CONFIG_MSIZE,
+    .interval = CONFIG_MEMPROF_INTERVAL, .nr_page = nr_page, .nr_line = nr_line,
+    .nr_ws = nr_ws_total };
+  bool ok = fwrite(&h, sizeof(h), 1, fp) == 1;
+  uint64_t i;
+  for (i = 0; ok && i < MEMPROF_NR_PAGE; i ++) {
+    MemProfPage p = { .addr = CONFIG_MBASE + (i << PAGE_SHIFT), .count = {
+      memprof_page[0][i], memprof_page[1][i], memprof_page[2][i] } };
+    if (p.count[0] + p.count[1] + p.count[2] != 0) ok = fwrite(&p, sizeof(p), 1, fp) == 1;
+  }
+  for (i = 0; ok && i < MEMPROF_NR_LINE; i ++) {
+    MemProfLine l = { .addr = CONFIG_MBASE + (i << MEMPROF_LINE_SHIFT),
+      .count = memprof_line[i] };
+    if (l.count != 0) ok = fwrite(&l, sizeof(l), 1, fp) == 1;
+  }
+  if (ok && nr_ws > 0) ok = fwrite(ws, sizeof(*ws), nr_ws, fp) == nr_ws;
+  if (ok && nr_ws_total > nr_ws) {
+    MemProfWS last = { g_nr_guest_inst, last_ws };
+    ok = fwrite(&last, sizeof(last), 1, fp) == 1;
+  }
+  return fclose(fp) == 0 && ok;
+}
+
+#define NR_HOT 5
+
+// print a summary and write the profile, the current interval is included
+// without being closed, so the profiling can go on after this
+void memprof_statistic() {
+  uint64_t total[3] = {}, nr_page = 0, nr_line = 0, top = 0;
+  uint64_t hot[NR_HOT] = {}, hot_count[NR_HOT] = {};
+  uint64_t i;
+  for (i = 0; i < MEMPROF_NR_PAGE; i ++) {
+    uint64_t c = memprof_page[0][i] + memprof_page[1][i] + memprof_page[2][i];
+    if (c == 0) continue;
+    total[0] += memprof_page[0][i];
+    total[1] += memprof_page[1][i];
+    total[2] += memprof_page[2][i];
+    nr_page ++;
+    top = i + 1;
+    if (c <= hot_count[NR_HOT - 1]) continue;
+    int j;
+    for (j = NR_HOT - 1; j > 0 && hot_count[j - 1] < c; j --) {
+      hot[j] = hot[j - 1];
+      hot_count[j] = hot_count[j - 1];
+    }
+    hot[j] = i;
+    hot_count[j] = c;
+  }
+  for (i = 0; i < MEMPROF_NR_LINE; i ++) nr_line += (memprof_line[i] != 0);
+
+  uint64_t last_ws = ws_count();
+  bool has_last = (last_ws != 0 || nr_ws == 0);
+  uint64_t nr_ws_total = nr_ws + has_last;
+  uint64_t peak = last_ws, sum = (has_last ? last_ws : 0);
+  for (i = 0; i < nr_ws; i ++) {
+    if (ws[i].nr_page > peak) peak = ws[i].nr_page;
+    sum += ws[i].nr_page;
+  }
+
+  Log("memory profile: %" PRIu64 " ifetches, %" PRIu64 " reads, %" PRIu64 " writes to pmem",
+      total[MEM_TYPE_IFETCH], total[MEM_TYPE_READ], total[MEM_TYPE_WRITE]);
+  Log("memory profile: %" PRIu64 " pages (%" PRIu64 " KB) and %" PRIu64 " cache lines touched, "
+      "the highest touched address is " FMT_PADDR, nr_page, nr_page * PAGE_SIZE / 1024,
+      nr_line, (paddr_t)(CONFIG_MBASE + top * PAGE_SIZE - 1));
+  Log("memory profile: working set of %" PRIu64 " intervals of %d instructions, "
+      "peak = %" PRIu64 " pages, average = %" PRIu64 " pages", nr_ws_total,
+      CONFIG_MEMPROF_INTERVAL, peak, (nr_ws_total ? sum / nr_ws_total : 0));
+  for (i = 0; i < NR_HOT && hot_count[i] != 0; i ++) {
+    paddr_t addr = CONFIG_MBASE + (hot[i] << PAGE_SHIFT);
+    const char *sym = symbol_lookup(addr, NULL);
+    Log("memory profile: hot page " FMT_PADDR ", %" PRIu64 " accesses%s%s", addr,
+        hot_count[i], (sym ? ", " : ""), (sym ? sym : ""));
+  }
+  if (write_profile(CONFIG_MEMPROF_FILE, nr_page, nr_line, nr_ws_total, last_ws)) {
+    Log("memory profile is written to %s", CONFIG_MEMPROF_FILE);
+  } else {
+    Log("Can not write the memory profile to %s", CONFIG_MEMPROF_FILE);
+  }
+}
+#endif
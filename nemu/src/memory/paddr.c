@@ -13,17 +13,97 @@
  * See the Mulan PSL v2 for more details.
  ***************************************************************************************/
 
+#define _GNU_SOURCE // mremap()
+#include <cpu/difftest.h>
+#include <cpu/invalidate.h>
 #include <device/mmio.h>
 #include <isa.h>
 #include <memory/host.h>
 #include <memory/paddr.h>
+#include <memory/region.h>
+#include <memory/vaddr.h>
+#ifndef CONFIG_TARGET_AM
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
-#if defined(CONFIG_PMEM_MALLOC)
+#if defined(CONFIG_PMEM_MALLOC) || defined(CONFIG_PMEM_MMAP)
 static uint8_t *pmem = NULL;
 #else // CONFIG_PMEM_GARRAY
 static uint8_t pmem[CONFIG_MSIZE] PG_ALIGN = {};
 #endif
 
+#ifdef CONFIG_PMEM_MMAP
+#include <sched.h>
+#include <signal.h>
+
+#define PMEM_CHUNK MUXDEF(CONFIG_PMEM_HUGEPAGE, (2ul << 20), (64ul << 10))
+#define PMEM_MAP_SIZE ROUNDUP(CONFIG_MSIZE, PMEM_CHUNK)
+
+// Map `size` bytes, a multiple of PMEM_CHUNK, aligned to PMEM_CHUNK.
+static uint8_t *pmem_map(size_t size, int prot) {
+    uint8_t *p = mmap(NULL, size + PMEM_CHUNK, prot,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+    uint8_t *aligned = (uint8_t *)ROUNDUP((uintptr_t)p, PMEM_CHUNK);
+    if (aligned != p)
+        munmap(p, aligned - p);
+    munmap(aligned + size, p + PMEM_CHUNK - aligned);
+    IFDEF(CONFIG_PMEM_HUGEPAGE, madvise(aligned, size, MADV_HUGEPAGE));
+    return aligned;
+}
+
+#ifdef CONFIG_MEM_RANDOM
+#define LAZY_RANDOM 1
+// pmem is inaccessible until a chunk is first touched. The SIGSEGV handler
+// then fills a new chunk with the random byte and moves it into place, so
+// harts in other threads never observe a partially filled chunk.
+enum { CHUNK_UNTOUCHED, CHUNK_FILLING, CHUNK_READY };
+static uint8_t chunk_state[PMEM_MAP_SIZE / PMEM_CHUNK];
+static uint8_t random_byte;
+static struct sigaction old_segv;
+
+static void fill_chunk(size_t i) {
+    uint8_t expected = CHUNK_UNTOUCHED;
+    if (!__atomic_compare_exchange_n(&chunk_state[i], &expected,
+                                     CHUNK_FILLING, false, __ATOMIC_ACQ_REL,
+                                     __ATOMIC_ACQUIRE)) {
+        while (__atomic_load_n(&chunk_state[i], __ATOMIC_ACQUIRE) !=
+               CHUNK_READY)
+            sched_yield();
+        return;
+    }
+    uint8_t *chunk = pmem_map(PMEM_CHUNK, PROT_READ | PROT_WRITE);
+    assert(chunk);
+    memset(chunk, random_byte, PMEM_CHUNK);
+    void *ret = mremap(chunk, PMEM_CHUNK, PMEM_CHUNK,
+                       MREMAP_MAYMOVE | MREMAP_FIXED, pmem + i * PMEM_CHUNK);
+    assert(ret != MAP_FAILED);
+    __atomic_store_n(&chunk_state[i], CHUNK_READY, __ATOMIC_RELEASE);
+}
+
+static void pmem_fault(int sig, siginfo_t *info, void *ucontext) {
+    uint8_t *addr = info->si_addr;
+    if (addr < pmem || addr >= pmem + PMEM_MAP_SIZE) {
+        // not ours, the faulting access is retried with the old handler
+        sigaction(SIGSEGV, &old_segv, NULL);
+        return;
+    }
+    fill_chunk((addr - pmem) / PMEM_CHUNK);
+}
+
+static void init_lazy_random() {
+    random_byte = rand();
+    struct sigaction sa = {.sa_sigaction = pmem_fault,
+                           .sa_flags = SA_SIGINFO | SA_NODEFER};
+    sigemptyset(&sa.sa_mask);
+    int ret = sigaction(SIGSEGV, &sa, &old_segv);
+    assert(ret == 0);
+}
+#endif
+#endif
+
 uint8_t *guest_to_host(paddr_t paddr) { return pmem + paddr - CONFIG_MBASE; }
 paddr_t host_to_guest(uint8_t *haddr) { return haddr - pmem + CONFIG_MBASE; }
 
@@ -33,6 +113,7 @@ static word_t pmem_read(paddr_t addr, int len) {
 }
 
 static void pmem_write(paddr_t addr, int len, word_t data) {
+    code_invalidate(addr, len);
     host_write(guest_to_host(addr), len, data);
 }
 
@@ -42,20 +123,203 @@ static void out_of_bound(paddr_t addr) {
           addr, PMEM_LEFT, PMEM_RIGHT, cpu.pc);
 }
 
+static word_t *atomic_host_addr(paddr_t addr) {
+    if (unlikely(!in_pmem(addr) || addr % sizeof(word_t) != 0)) {
+        panic("atomic access to address = " FMT_PADDR
+              " is not supported at pc = " FMT_WORD,
+              addr, cpu.pc);
+    }
+    return (word_t *)guest_to_host(addr);
+}
+
+void pmem_prefault(paddr_t addr, size_t len) {
+#ifdef LAZY_RANDOM
+    // system calls fail with EFAULT instead of faulting on untouched chunks
+    if (len == 0)
+        return;
+    size_t i = (addr - CONFIG_MBASE) / PMEM_CHUNK;
+    size_t end = (addr - CONFIG_MBASE + len - 1) / PMEM_CHUNK;
+    for (; i <= end; i++) {
+        if (__atomic_load_n(&chunk_state[i], __ATOMIC_ACQUIRE) != CHUNK_READY)
+            fill_chunk(i);
+    }
+#endif
+}
+
+#ifndef CONFIG_TARGET_AM
+// Whether the page at `addr` only holds zero. Untouched chunks with the lazy
+// random initialization are also reported as zero without filling them.
+bool pmem_page_is_zero(paddr_t addr) {
+#ifdef LAZY_RANDOM
+    if (__atomic_load_n(&chunk_state[(addr - CONFIG_MBASE) / PMEM_CHUNK],
+                        __ATOMIC_ACQUIRE) != CHUNK_READY)
+        return true;
+#endif
+    uint64_t *p = (uint64_t *)guest_to_host(addr);
+    int i;
+    for (i = 0; i < PAGE_SIZE / sizeof(uint64_t); i++) {
+        if (p[i] != 0)
+            return false;
+    }
+    return true;
+}
+
+// fill pmem with zero, without committing host memory if possible
+void pmem_reset() {
+#ifdef CONFIG_PMEM_MMAP
+    void *p = mmap(pmem, PMEM_MAP_SIZE, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED,
+                   -1, 0);
+    Assert(p != MAP_FAILED, "failed to remap pmem");
+    IFDEF(CONFIG_PMEM_HUGEPAGE, madvise(pmem, PMEM_MAP_SIZE, MADV_HUGEPAGE));
+    IFDEF(LAZY_RANDOM, memset(chunk_state, CHUNK_READY, sizeof(chunk_state)));
+#else
+    memset(pmem, 0, CONFIG_MSIZE);
+#endif
+}
+
+// Replace the whole pages inside [addr, addr + len) with a private mapping
+// of `fd` at `offset`, or with anonymous zero pages if `fd` is -1. Return the
+// number of bytes before the replaced pages in `head`, and the number of
+// replaced bytes in `body`, which is 0 if `offset` is not congruent with the
+// host address of `addr` modulo the page size, or if pmem is not mapped by
+// NEMU itself.
+static bool replace_pages(paddr_t addr, size_t len, int fd, off_t offset,
+                          size_t *head, size_t *body) {
+    *head = len;
+    *body = 0;
+#ifndef CONFIG_PMEM_MMAP
+    // the global array and the malloc()ed block are owned by the C runtime
+    return true;
+#else
+    uint8_t *p = guest_to_host(addr);
+    if ((uintptr_t)p % PAGE_SIZE != offset % PAGE_SIZE)
+        return true;
+    *head = ROUNDUP(p, PAGE_SIZE) - (uintptr_t)p;
+    if (*head >= len) {
+        *head = len;
+        return true;
+    }
+    *body = ROUNDDOWN(len - *head, PAGE_SIZE);
+    if (*body == 0)
+        return true;
+#ifdef LAZY_RANDOM
+    paddr_t start = addr + *head;
+    // A chunk partially covered by the new pages is filled first, otherwise
+    // filling it later would drop them.
+    if ((start - CONFIG_MBASE) % PMEM_CHUNK != 0)
+        pmem_prefault(start, 1);
+    if ((start + *body - CONFIG_MBASE) % PMEM_CHUNK != 0)
+        pmem_prefault(start + *body - 1, 1);
+#endif
+    void *ret =
+        (fd < 0 ? mmap(p + *head, *body, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED,
+                       -1, 0)
+                : mmap(p + *head, *body, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_FIXED, fd, offset + *head));
+    if (ret == MAP_FAILED)
+        return false;
+#ifdef LAZY_RANDOM
+    size_t i;
+    for (i = (start - CONFIG_MBASE) / PMEM_CHUNK;
+         i <= (start + *body - 1 - CONFIG_MBASE) / PMEM_CHUNK; i++) {
+        __atomic_store_n(&chunk_state[i], CHUNK_READY, __ATOMIC_RELEASE);
+    }
+#endif
+    return true;
+#endif
+}
+
+// Load [addr, addr + len) from `fd` at `offset`. With PMEM_MMAP, the whole
+// pages are mapped copy-on-write when the alignment allows, so they are only read from the
+// file when the guest touches them.
+bool pmem_load_file(paddr_t addr, size_t len, int fd, off_t offset) {
+    size_t head, body;
+    if (!replace_pages(addr, len, fd, offset, &head, &body))
+        return false;
+    size_t tail = len - head - body;
+    pmem_prefault(addr, head);
+    pmem_prefault(addr + head + body, tail);
+    return pread(fd, guest_to_host(addr), head, offset) == head &&
+           pread(fd, guest_to_host(addr + head + body), tail,
+                 offset + head + body) == tail;
+}
+
+// Fill [addr, addr + len) with zero. With PMEM_MMAP, the whole pages are
+// replaced with anonymous ones, which take no host memory until the guest touches them.
+bool pmem_zero(paddr_t addr, size_t len) {
+    size_t head, body;
+    if (!replace_pages(addr, len, -1, (uintptr_t)guest_to_host(addr),
+                       &head, &body))
+        return false;
+    memset(guest_to_host(addr), 0, head);
+    memset(guest_to_host(addr + head + body), 0, len - head - body);
+    return true;
+}
+#endif
+
 void init_mem() {
 #if defined(CONFIG_PMEM_MALLOC)
     pmem = malloc(CONFIG_MSIZE);
     assert(pmem);
+#elif defined(CONFIG_PMEM_MMAP)
+    pmem = pmem_map(PMEM_MAP_SIZE,
+                    MUXDEF(LAZY_RANDOM, PROT_NONE, PROT_READ | PROT_WRITE));
+    Assert(pmem, "failed to map pmem of size %#x", CONFIG_MSIZE);
 #endif
+#ifdef LAZY_RANDOM
+    init_lazy_random();
+#else
     IFDEF(CONFIG_MEM_RANDOM, memset(pmem, rand(), CONFIG_MSIZE));
+#endif
+    tlb_flush();
     Log("physical memory area [" FMT_PADDR ", " FMT_PADDR "]", PMEM_LEFT,
         PMEM_RIGHT);
+    IFDEF(CONFIG_MEM_REGION, init_mem_region());
+}
+
+#ifdef CONFIG_MEM_REGION
+// The reference of difftest does not have these regions, so it skips the
+// instructions accessing them like those accessing devices.
+static inline uint8_t *region_host(paddr_t addr, int len, bool is_write) {
+    MemRegion *r = mem_region_find(addr, len);
+    if (r == NULL)
+        return NULL;
+    if (is_write && r->readonly) {
+        panic("write to ROM region %s at address = " FMT_PADDR
+              " at pc = " FMT_WORD,
+              r->name, addr, cpu.pc);
+    }
+    difftest_skip_ref();
+    return r->space + (addr - r->low);
+}
+#endif
+
+#ifdef CONFIG_DEVICE
+// Difftest should skip the instructions accessing devices. Accesses to
+// passive MMIO regions therefore go through mmio_read()/mmio_write() while
+// it is attached.
+static inline MMIOMem *passive_mem(paddr_t addr, int len) {
+    MMIOMem *m = mmio_mem_find(addr, len);
+    return (m != NULL && !difftest_is_attached() ? m : NULL);
 }
+#endif
 
 word_t paddr_read(paddr_t addr, int len) {
     if (likely(in_pmem(addr)))
         return pmem_read(addr, len);
-    IFDEF(CONFIG_DEVICE, return mmio_read(addr, len));
+#ifdef CONFIG_MEM_REGION
+    uint8_t *r = region_host(addr, len, false);
+    if (r != NULL)
+        return host_read(r, len);
+#endif
+#ifdef CONFIG_DEVICE
+    MMIOMem *m = passive_mem(addr, len);
+    if (m != NULL)
+        return host_read(m->space + (addr - m->low), len);
+    return mmio_read(addr, len);
+#endif
     out_of_bound(addr);
     return 0;
 }
@@ -65,6 +329,186 @@ void paddr_write(paddr_t addr, int len, word_t data) {
         pmem_write(addr, len, data);
         return;
     }
-    IFDEF(CONFIG_DEVICE, mmio_write(addr, len, data); return);
+#ifdef CONFIG_MEM_REGION
+    uint8_t *r = region_host(addr, len, true);
+    if (r != NULL) {
+        host_write(r, len, data);
+        return;
+    }
+#endif
+#ifdef CONFIG_DEVICE
+    MMIOMem *m = passive_mem(addr, len);
+    if (m != NULL) {
+        // marked after writing, so the device never clears the mark
+        // before it can see the new data
+        host_write(m->space + (addr - m->low), len, data);
+        mmio_mem_dirty(m, addr, len);
+        return;
+    }
+    mmio_write(addr, len, data);
+    return;
+#endif
     out_of_bound(addr);
 }
+
+// Find the span from `addr` backed by one kind of memory. Return its length,
+// at most `len`, and set `host` to its host address, or to NULL if it is MMIO
+// accessed through the callbacks. Return 0 if `addr` is unmapped, or if it is
+// in ROM and `is_write`.
+static size_t block_span(paddr_t addr, size_t len, bool is_write,
+                         uint8_t **host) {
+    size_t n = 0;
+    *host = NULL;
+    if (in_pmem(addr)) {
+        *host = guest_to_host(addr);
+        n = (size_t)PMEM_RIGHT - addr + 1;
+        return (n < len ? n : len);
+    }
+#ifdef CONFIG_MEM_REGION
+    MemRegion *r = mem_region_find(addr, 1);
+    if (r != NULL) {
+        if (is_write && r->readonly)
+            return 0;
+        *host = r->space + (addr - r->low);
+        n = r->size - (addr - r->low);
+        return (n < len ? n : len);
+    }
+#endif
+#ifdef CONFIG_DEVICE
+    int i;
+    for (i = 0; i < nr_mmio_mem; i++) {
+        if (addr - mmio_mem[i].low < mmio_mem[i].size) {
+            *host = mmio_mem[i].space + (addr - mmio_mem[i].low);
+            n = mmio_mem[i].size - (addr - mmio_mem[i].low);
+            return (n < len ? n : len);
+        }
+    }
+    n = mmio_map_span(addr);
+#endif
+    return (n < len ? n : len);
+}
+
+// Check the whole range first, so nothing is accessed if part of it fails.
+static bool block_check(paddr_t addr, size_t len, bool is_write) {
+    uint8_t *host;
+    while (len > 0) {
+        size_t n = block_span(addr, len, is_write, &host);
+        if (n == 0)
+            return false;
+        addr += n;
+        len -= n;
+    }
+    return true;
+}
+
+#ifdef CONFIG_DEVICE
+// the widest aligned access to MMIO at `addr` within `len` bytes
+static int mmio_access_len(paddr_t addr, size_t len) {
+    int n = sizeof(word_t);
+    while (n > len || addr % n != 0)
+        n /= 2;
+    return n;
+}
+
+static void mmio_read_block(paddr_t addr, uint8_t *buf, size_t len) {
+    size_t i;
+    for (i = 0; i < len;) {
+        int l = mmio_access_len(addr + i, len - i);
+        word_t data = mmio_read(addr + i, l);
+        memcpy(buf + i, &data, l);
+        i += l;
+    }
+}
+
+static void mmio_write_block(paddr_t addr, const uint8_t *buf, size_t len) {
+    size_t i;
+    for (i = 0; i < len;) {
+        int l = mmio_access_len(addr + i, len - i);
+        word_t data = 0;
+        memcpy(&data, buf + i, l);
+        mmio_write(addr + i, l, data);
+        i += l;
+    }
+}
+#endif
+
+static bool read_block(paddr_t addr, void *buf, size_t len, bool peek) {
+    if (!block_check(addr, len, false))
+        return false;
+    uint8_t *p = buf;
+    while (len > 0) {
+        uint8_t *host;
+        size_t n = block_span(addr, len, false, &host);
+        if (host != NULL) {
+            memcpy(p, host, n);
+        } else if (peek) {
+            IFDEF(CONFIG_DEVICE, mmio_peek(addr, p, n));
+        } else {
+            IFDEF(CONFIG_DEVICE, mmio_read_block(addr, p, n));
+        }
+        addr += n;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool paddr_read_block(paddr_t addr, void *buf, size_t len) {
+    return read_block(addr, buf, len, false);
+}
+
+bool paddr_peek_block(paddr_t addr, void *buf, size_t len) {
+    return read_block(addr, buf, len, true);
+}
+
+bool paddr_write_block(paddr_t addr, const void *buf, size_t len) {
+    if (!block_check(addr, len, true))
+        return false;
+    const uint8_t *p = buf;
+    while (len > 0) {
+        uint8_t *host;
+        size_t n = block_span(addr, len, true, &host);
+        if (in_pmem(addr)) {
+            // code_invalidate() only looks at the first and the last page
+            size_t i, l;
+            for (i = 0; i < n; i += l) {
+                l = PAGE_SIZE - (addr + i) % PAGE_SIZE;
+                if (l > n - i)
+                    l = n - i;
+                code_invalidate(addr + i, l);
+            }
+            memcpy(host, p, n);
+        } else if (host != NULL) {
+            memcpy(host, p, n);
+#ifdef CONFIG_DEVICE
+            MMIOMem *m = mmio_mem_find(addr, n);
+            if (m != NULL)
+                mmio_mem_dirty(m, addr, n);
+#endif
+        } else {
+            IFDEF(CONFIG_DEVICE, mmio_write_block(addr, p, n));
+        }
+        addr += n;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+word_t paddr_amo(paddr_t addr, word_t (*op)(word_t old, word_t src),
+                 word_t src) {
+    word_t *p = atomic_host_addr(addr);
+    code_invalidate(addr, sizeof(word_t));
+    word_t old = __atomic_load_n(p, __ATOMIC_SEQ_CST);
+    while (!__atomic_compare_exchange_n(p, &old, op(old, src), false,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+        ;
+    return old;
+}
+
+bool paddr_cmpxchg(paddr_t addr, word_t old, word_t data) {
+    word_t *p = atomic_host_addr(addr);
+    code_invalidate(addr, sizeof(word_t));
+    return __atomic_compare_exchange_n(p, &old, data, false, __ATOMIC_SEQ_CST,
+                                       __ATOMIC_SEQ_CST);
+}
@@ -0,0 +1,119 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+
+#include <memory/paddr.h>
+#include <memory/region.h>
+#include <utils.h>
+
+#ifdef CONFIG_MEM_REGION
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MemRegion mem_region[NR_MEM_REGION] = {};
+int nr_mem_region = 0;
+MemRegionLeaf *mem_region_dir[1 << (32 - MEM_REGION_DIR_SHIFT)] = {};
+
+static void report_region_overlap(const char *name1, paddr_t l1, paddr_t r1,
+    const char *name2, paddr_t l2, paddr_t r2) {
+  panic("memory region %s@[" FMT_PADDR ", " FMT_PADDR "] is overlapped "
+               "with %s@[" FMT_PADDR ", " FMT_PADDR "]", name1, l1, r1, name2, l2, r2);
+}
+
+void add_mem_region(const char *name, paddr_t addr, paddr_t size,
+    bool readonly, const char *file) {
+  Assert(nr_mem_region < NR_MEM_REGION, "too many memory regions");
+  Assert(size != 0 && addr % PAGE_SIZE == 0 && size % PAGE_SIZE == 0,
+      "memory region %s is not page aligned", name);
+  paddr_t left = addr, right = addr + size - 1;
+  Assert(right >= left && (uint64_t)right >> 32 == 0,
+      "memory region %s is beyond 4GB", name);
+  if (in_pmem(left) || in_pmem(right) || (left < PMEM_LEFT && right > PMEM_RIGHT)) {
+    report_region_overlap(name, left, right, "pmem", PMEM_LEFT, PMEM_RIGHT);
+  }
+  for (int i = 0; i < nr_mem_region; i ++) {
+    MemRegion *r = &mem_region[i];
+    if (left <= r->low + r->size - 1 && right >= r->low) {
+      report_region_overlap(name, left, right, r->name, r->low, r->low + r->size - 1);
+    }
+  }
+  mem_region[nr_mem_region ++] = (MemRegion){ .name = name, .file = file,
+    .low = addr, .size = size, .readonly = readonly };
+}
+
+// Map the region without reserving swap. The content of a file is mapped
+// privately, so it is only read when the guest touches it, and writes to
+// RAM regions never reach the file.
+static void map_region(MemRegion *r) {
+  r->space = mmap(NULL, r->size, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  Assert(r->space != MAP_FAILED, "failed to map memory region %s", r->name);
+  if (r->file != NULL) {
+    int fd = open(r->file, O_RDONLY);
+    Assert(fd >= 0, "Can not open '%s'", r->file);
+    struct stat st;
+    Assert(fstat(fd, &st) == 0, "Can not stat '%s'", r->file);
+    Assert(st.st_size <= r->size, "'%s' of size %ld does not fit in memory region %s",
+        r->file, (long)st.st_size, r->name);
+    if (st.st_size > 0) {
+      void *p = mmap(r->space, st.st_size, PROT_READ | PROT_WRITE,
+          MAP_PRIVATE | MAP_FIXED, fd, 0);
+      Assert(p != MAP_FAILED, "failed to map '%s'", r->file);
+    }
+    close(fd);
+  }
+  // writes to ROM are rejected by paddr_write(), this catches the others
+  if (r->readonly) mprotect(r->space, r->size, PROT_READ);
+}
+
+void init_mem_region() {
+  for (int i = 0; i < nr_mem_region; i ++) {
+    MemRegion *r = &mem_region[i];
+    map_region(r);
+    uint64_t a;
+    for (a = r->low; a < (uint64_t)r->low + r->size; a += PAGE_SIZE) {
+      MemRegionLeaf **leaf = &mem_region_dir[a >> MEM_REGION_DIR_SHIFT];
+      if (*leaf == NULL) {
+        *leaf = calloc(1, sizeof(MemRegionLeaf));
+        assert(*leaf);
+      }
+      (**leaf)[(a >> PAGE_SHIFT) % ARRLEN(**leaf)] = i + 1;
+    }
+    // ROM is restored from its file, only RAM is saved in snapshots
+    if (!r->readonly) {
+      char *name = malloc(strlen(r->name) + 8);
+      assert(name);
+      sprintf(name, "region.%s", r->name);
+      snapshot_add(name, r->space, r->size, NULL);
+    }
+    Log("memory region '%s' at [" FMT_PADDR ", " FMT_PADDR "], %s%s%s",
+        r->name, r->low, r->low + r->size - 1, r->readonly ? "ROM" : "RAM",
+        r->file ? " from " : "", r->file ? r->file : "");
+  }
+}
+
+void mem_region_display() {
+  printf("%-16s[" FMT_PADDR ", " FMT_PADDR "] RAM\n", "pmem", PMEM_LEFT, PMEM_RIGHT);
+  for (int i = 0; i < nr_mem_region; i ++) {
+    MemRegion *r = &mem_region[i];
+    printf("%-16s[" FMT_PADDR ", " FMT_PADDR "] %s%s%s\n", r->name, r->low,
+        r->low + r->size - 1, r->readonly ? "ROM" : "RAM",
+        r->file ? " " : "", r->file ? r->file : "");
+  }
+}
+
+#endif
@@ -14,16 +14,121 @@
 ***************************************************************************************/
 
 #include <isa.h>
+#include <cpu/invalidate.h>
+#include <memory/host.h>
+#include <memory/memprof.h>
 #include <memory/paddr.h>
+#include <memory/vaddr.h>
+
+// A direct-mapped software TLB for each type of access, which maps a virtual
+// page to a page in pmem. A hit only compares the tag and accesses the host
+// memory. Pages outside pmem (MMIO) are never cached. Accesses which need no
+// translation (MMU_DIRECT) bypass the TLB, since it is cheaper to check the
+// physical address directly.
+#define TLB_SIZE 256
+
+typedef struct {
+  vaddr_t vpage;
+  paddr_t ppage;
+  uint8_t *hpage;
+} TLBEntry;
+
+// indexed by MEM_TYPE_*
+static HART_LOCAL TLBEntry tlb[3][TLB_SIZE];
+
+// an unaligned access never matches the tag of an entry
+#define TLB_TAG(addr, len) ((addr) & (~(vaddr_t)PAGE_MASK | ((len) - 1)))
+
+static inline TLBEntry* tlb_entry(int type, vaddr_t addr) {
+  return &tlb[type][(addr >> PAGE_SHIFT) % TLB_SIZE];
+}
+
+void tlb_flush() {
+  // no tag is all ones
+  memset(tlb, 0xff, sizeof(tlb));
+}
+
+// walk the page table on a miss, and cache the page if it is in pmem
+static paddr_t tlb_fill(int type, vaddr_t addr, int len) {
+  paddr_t pg = isa_mmu_translate(addr, len, type);
+  Assert((pg & PAGE_MASK) == MEM_RET_OK, "failed to translate vaddr = " FMT_WORD, addr);
+  paddr_t paddr = pg | (addr & PAGE_MASK);
+  if (in_pmem(paddr)) {
+    TLBEntry *e = tlb_entry(type, addr);
+    e->vpage = addr & ~(vaddr_t)PAGE_MASK;
+    e->ppage = pg;
+    e->hpage = guest_to_host(pg);
+  }
+  return paddr;
+}
+
+// The memory profiler counts the guest accesses here rather than in
+// paddr_read()/paddr_write(), where the type of the access and the hits in
+// the TLB are unknown.
+static inline word_t tlb_read(int type, vaddr_t addr, int len) {
+  TLBEntry *e = tlb_entry(type, addr);
+  if (likely(e->vpage == TLB_TAG(addr, len))) {
+    memprof_access(type, e->ppage | (addr & PAGE_MASK));
+    return host_read(e->hpage + (addr & PAGE_MASK), len);
+  }
+  paddr_t paddr = tlb_fill(type, addr, len);
+  memprof_access(type, paddr);
+  return paddr_read(paddr, len);
+}
 
 word_t vaddr_ifetch(vaddr_t addr, int len) {
-  return paddr_read(addr, len);
+  if (isa_mmu_check(addr, len, MEM_TYPE_IFETCH) == MMU_DIRECT) {
+    memprof_access(MEM_TYPE_IFETCH, addr);
+    return paddr_read(addr, len);
+  }
+  return tlb_read(MEM_TYPE_IFETCH, addr, len);
 }
 
 word_t vaddr_read(vaddr_t addr, int len) {
-  return paddr_read(addr, len);
+  if (isa_mmu_check(addr, len, MEM_TYPE_READ) == MMU_DIRECT) {
+    memprof_access(MEM_TYPE_READ, addr);
+    return paddr_read(addr, len);
+  }
+  return tlb_read(MEM_TYPE_READ, addr, len);
 }
 
 void vaddr_write(vaddr_t addr, int len, word_t data) {
-  paddr_write(addr, len, data);
+  if (isa_mmu_check(addr, len, MEM_TYPE_WRITE) == MMU_DIRECT) {
+    memprof_access(MEM_TYPE_WRITE, addr);
+    paddr_write(addr, len, data);
+    return;
+  }
+  TLBEntry *e = tlb_entry(MEM_TYPE_WRITE, addr);
+  if (likely(e->vpage == TLB_TAG(addr, len))) {
+    memprof_access(MEM_TYPE_WRITE, e->ppage | (addr & PAGE_MASK));
+    code_invalidate(e->ppage | (addr & PAGE_MASK), len);
+    host_write(e->hpage + (addr & PAGE_MASK), len, data);
+    return;
+  }
+  paddr_t paddr = tlb_fill(MEM_TYPE_WRITE, addr, len);
+  memprof_access(MEM_TYPE_WRITE, paddr);
+  paddr_write(paddr, len, data);
+}
+
+// An atomic access is translated as a write, and always goes through
+// paddr_amo() or paddr_cmpxchg() rather than the host page in the TLB, so
+// that it stays atomic against the other harts.
+static paddr_t amo_translate(vaddr_t addr) {
+  int len = sizeof(word_t);
+  if (isa_mmu_check(addr, len, MEM_TYPE_WRITE) == MMU_DIRECT) return addr;
+  TLBEntry *e = tlb_entry(MEM_TYPE_WRITE, addr);
+  if (likely(e->vpage == TLB_TAG(addr, len))) return e->ppage | (addr & PAGE_MASK);
+  return tlb_fill(MEM_TYPE_WRITE, addr, len);
+}
+
+word_t vaddr_amo(vaddr_t addr, word_t (*op)(word_t old, word_t src), word_t src) {
+  paddr_t paddr = amo_translate(addr);
+  memprof_access(MEM_TYPE_WRITE, paddr);
+  return paddr_amo(paddr, op, src);
+}
+
+bool vaddr_cmpxchg(vaddr_t addr, word_t old, word_t data) {
+  paddr_t paddr = amo_translate(addr);
+  memprof_access(MEM_TYPE_WRITE, paddr);
+  return paddr_cmpxchg(paddr, old, data);
 }
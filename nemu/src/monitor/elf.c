@@ -0,0 +1,177 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+
+#include <isa.h>
+#include <memory/paddr.h>
+
+#ifndef CONFIG_TARGET_AM
+#include <elf.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifndef EM_LOONGARCH
+#define EM_LOONGARCH 258
+#endif
+
+#define ELF_CLASS MUXDEF(CONFIG_ISA64, ELFCLASS64, ELFCLASS32)
+#define ELF_MACHINE                                                            \
+    MUXDEF(CONFIG_ISA_x86, EM_386,                                             \
+           MUXDEF(CONFIG_ISA_mips32, EM_MIPS,                                  \
+                  MUXDEF(CONFIG_ISA_riscv, EM_RISCV, EM_LOONGARCH)))
+#define ELF_ST_TYPE MUXDEF(CONFIG_ISA64, ELF64_ST_TYPE, ELF32_ST_TYPE)
+
+typedef MUXDEF(CONFIG_ISA64, Elf64_Ehdr, Elf32_Ehdr) Elf_Ehdr;
+typedef MUXDEF(CONFIG_ISA64, Elf64_Phdr, Elf32_Phdr) Elf_Phdr;
+typedef MUXDEF(CONFIG_ISA64, Elf64_Shdr, Elf32_Shdr) Elf_Shdr;
+typedef MUXDEF(CONFIG_ISA64, Elf64_Sym, Elf32_Sym) Elf_Sym;
+
+typedef struct {
+    word_t addr, size;
+    const char *name; // points into the mapped image
+} Symbol;
+
+// the functions and objects in the image, sorted by their addresses
+static Symbol *symbols = NULL;
+static int nr_symbol = 0;
+
+static int symbol_cmp(const void *a, const void *b) {
+    word_t x = ((const Symbol *)a)->addr, y = ((const Symbol *)b)->addr;
+    return (x > y) - (x < y);
+}
+
+static void load_symbols(const uint8_t *elf, size_t size) {
+    const Elf_Ehdr *eh = (const Elf_Ehdr *)elf;
+    if (eh->e_shoff == 0 || eh->e_shoff + eh->e_shnum * sizeof(Elf_Shdr) > size)
+        return;
+    const Elf_Shdr *sh = (const Elf_Shdr *)(elf + eh->e_shoff);
+    int i;
+    for (i = 0; i < eh->e_shnum; i++) {
+        if (sh[i].sh_type != SHT_SYMTAB)
+            continue;
+        const Elf_Shdr *str = &sh[sh[i].sh_link];
+        if (sh[i].sh_link >= eh->e_shnum ||
+            sh[i].sh_offset + sh[i].sh_size > size ||
+            str->sh_offset + str->sh_size > size)
+            return;
+        const Elf_Sym *sym = (const Elf_Sym *)(elf + sh[i].sh_offset);
+        int n = sh[i].sh_size / sizeof(Elf_Sym), j;
+        symbols = malloc(sizeof(Symbol) * n);
+        assert(symbols);
+        for (j = 0; j < n; j++) {
+            int type = ELF_ST_TYPE(sym[j].st_info);
+            if ((type == STT_FUNC || type == STT_OBJECT) &&
+                sym[j].st_shndx != SHN_UNDEF && sym[j].st_name < str->sh_size) {
+                symbols[nr_symbol++] = (Symbol){
+                    sym[j].st_value, sym[j].st_size,
+                    (const char *)elf + str->sh_offset + sym[j].st_name};
+            }
+        }
+        qsort(symbols, nr_symbol, sizeof(Symbol), symbol_cmp);
+        return;
+    }
+}
+
+// Find the symbol containing `addr`. A symbol without size extends to the
+// next one.
+const char *symbol_lookup(word_t addr, word_t *offset) {
+    int lo = 0, hi = nr_symbol;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (symbols[mid].addr <= addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == 0)
+        return NULL;
+    Symbol *s = &symbols[lo - 1];
+    if (s->size != 0 && addr - s->addr >= s->size)
+        return NULL;
+    if (offset != NULL)
+        *offset = addr - s->addr;
+    return s->name;
+}
+
+// Load the PT_LOAD segments of an ELF image, and return the size of the image
+// in pmem from the reset vector. In pmem the file is mapped copy-on-write
+// where the alignment allows, and BSS is filled with anonymous zero pages.
+// Segments elsewhere are copied with paddr_write_block().
+long load_elf(const char *file) {
+    int fd = open(file, O_RDONLY);
+    Assert(fd >= 0, "Can not open '%s'", file);
+    struct stat st;
+    Assert(fstat(fd, &st) == 0, "Can not stat '%s'", file);
+    // kept mapped for the names of the symbols
+    const uint8_t *elf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    Assert(elf != MAP_FAILED, "Can not map '%s'", file);
+
+    const Elf_Ehdr *eh = (const Elf_Ehdr *)elf;
+    Assert(st.st_size >= sizeof(*eh) && eh->e_ident[EI_CLASS] == ELF_CLASS &&
+               eh->e_ident[EI_DATA] == ELFDATA2LSB &&
+               eh->e_machine == ELF_MACHINE,
+           "'%s' is not an ELF image for %s", file, str(__GUEST_ISA__));
+    Assert(eh->e_phoff + eh->e_phnum * sizeof(Elf_Phdr) <= st.st_size,
+           "'%s' is truncated", file);
+
+    const Elf_Phdr *ph = (const Elf_Phdr *)(elf + eh->e_phoff);
+    paddr_t end = RESET_VECTOR;
+    int i;
+    for (i = 0; i < eh->e_phnum; i++) {
+        if (ph[i].p_type != PT_LOAD || ph[i].p_memsz == 0)
+            continue;
+        paddr_t addr = ph[i].p_paddr;
+        Assert(ph[i].p_filesz <= ph[i].p_memsz &&
+                   ph[i].p_offset + ph[i].p_filesz <= st.st_size,
+               "'%s' is truncated", file);
+        bool ok;
+        if (in_pmem(addr) && ph[i].p_memsz <= CONFIG_MSIZE &&
+            addr - PMEM_LEFT <= CONFIG_MSIZE - ph[i].p_memsz) {
+            ok = pmem_load_file(addr, ph[i].p_filesz, fd, ph[i].p_offset) &&
+                 pmem_zero(addr + ph[i].p_filesz,
+                           ph[i].p_memsz - ph[i].p_filesz);
+            if (addr + ph[i].p_memsz > end)
+                end = addr + ph[i].p_memsz;
+        } else {
+            // other memory, such as SRAM in a memory region
+            size_t bss = ph[i].p_memsz - ph[i].p_filesz;
+            uint8_t *zero = calloc(1, bss + 1);
+            assert(zero);
+            ok = paddr_write_block(addr, elf + ph[i].p_offset,
+                                   ph[i].p_filesz) &&
+                 paddr_write_block(addr + ph[i].p_filesz, zero, bss);
+            free(zero);
+        }
+        Assert(ok, "Can not load the segment at " FMT_PADDR, addr);
+    }
+
+    cpu.pc = eh->e_entry;
+#if NR_HART > 1
+    for (i = 0; i < NR_HART; i++) {
+        hart[i].pc = eh->e_entry;
+    }
+#endif
+    load_symbols(elf, st.st_size);
+    close(fd);
+
+    Log("The image is %s, entry = " FMT_WORD ", %d symbols", file, cpu.pc,
+        nr_symbol);
+    return end - RESET_VECTOR;
+}
+#else
+const char *symbol_lookup(word_t addr, word_t *offset) { return NULL; }
+#endif
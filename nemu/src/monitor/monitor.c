@@ -14,7 +14,9 @@
  ***************************************************************************************/
 
 #include <isa.h>
+#include <cpu/cpu.h>
 #include <memory/paddr.h>
+#include <memory/region.h>
 
 void init_rand();
 void init_log(const char *log_file);
@@ -22,7 +24,9 @@ void init_mem();
 void init_difftest(char *ref_so_file, long img_size, int port);
 void init_device();
 void init_sdb();
+void init_cpu_snapshot();
 void init_disasm(const char *triple);
+long load_elf(const char *file);
 
 static void welcome() {
     Log("Trace: %s", MUXDEF(CONFIG_TRACE, ANSI_FMT("ON", ANSI_FG_GREEN),
@@ -40,14 +44,18 @@ static void welcome() {
 }
 
 #ifndef CONFIG_TARGET_AM
+#include <elf.h>
 #include <getopt.h>
 
 void sdb_set_batch_mode();
+void sdb_set_save_snapshot(const char *path, uint64_t nr_inst);
 
 static char *log_file = NULL;
+static bool batch_mode = false;
 static char *diff_so_file = NULL;
 static char *img_file = NULL;
 static int difftest_port = 1234;
+static char *load_snapshot_file = NULL;
 
 static long load_img() {
     if (img_file == NULL) {
@@ -58,12 +66,20 @@ static long load_img() {
     FILE *fp = fopen(img_file, "rb");
     Assert(fp, "Can not open '%s'", img_file);
 
+    char magic[SELFMAG];
+    if (fread(magic, 1, SELFMAG, fp) == SELFMAG &&
+        memcmp(magic, ELFMAG, SELFMAG) == 0) {
+        fclose(fp);
+        return load_elf(img_file);
+    }
+
     fseek(fp, 0, SEEK_END);
     long size = ftell(fp);
 
     Log("The image is %s, size = %ld", img_file, size);
 
     fseek(fp, 0, SEEK_SET);
+    pmem_prefault(RESET_VECTOR, size);
     int ret = fread(guest_to_host(RESET_VECTOR), size, 1, fp);
     assert(ret == 1);
 
@@ -71,12 +87,50 @@ static long load_img() {
     return size;
 }
 
+// FILE@N saves after N instructions, FILE alone saves when NEMU exits
+static void parse_save_snapshot(char *arg) {
+    uint64_t nr_inst = 0;
+    char *at = strrchr(arg, '@');
+    if (at != NULL) {
+        char *end;
+        nr_inst = strtoull(at + 1, &end, 0);
+        Assert(*end == '\0' && end != at + 1,
+               "bad instruction count in --save-snapshot=%s", arg);
+        *at = '\0';
+    }
+    sdb_set_save_snapshot(arg, nr_inst);
+}
+
+#ifdef CONFIG_MEM_REGION
+// NAME,BASE,SIZE,ro|rw[,FILE]
+static void parse_region(char *arg) {
+    char *field[5] = {};
+    int n = 0;
+    char *p;
+    for (p = strtok(arg, ","); p != NULL && n < 5; p = strtok(NULL, ","))
+        field[n++] = p;
+    Assert(n >= 4 && p == NULL, "bad memory region --region=%s", arg);
+    char *end1, *end2;
+    paddr_t base = strtoull(field[1], &end1, 0);
+    paddr_t size = strtoull(field[2], &end2, 0);
+    Assert(*end1 == '\0' && *end2 == '\0', "bad address or size of region %s",
+           field[0]);
+    Assert(strcmp(field[3], "ro") == 0 || strcmp(field[3], "rw") == 0,
+           "bad permission '%s' of region %s, should be ro or rw", field[3],
+           field[0]);
+    add_mem_region(field[0], base, size, field[3][1] == 'o', field[4]);
+}
+#endif
+
 static int parse_args(int argc, char *argv[]) {
     const struct option table[] = {
         {"batch", no_argument, NULL, 'b'},
         {"log", required_argument, NULL, 'l'},
         {"diff", required_argument, NULL, 'd'},
         {"port", required_argument, NULL, 'p'},
+        {"save-snapshot", required_argument, NULL, 'S'},
+        {"load-snapshot", required_argument, NULL, 'L'},
+        {"region", required_argument, NULL, 'r'},
         {"help", no_argument, NULL, 'h'},
         {0, 0, NULL, 0},
     };
@@ -85,6 +139,7 @@ static int parse_args(int argc, char *argv[]) {
         switch (o) {
         case 'b':
             sdb_set_batch_mode();
+            batch_mode = true;
             break;
         case 'p':
             sscanf(optarg, "%d", &difftest_port);
@@ -95,6 +150,16 @@ static int parse_args(int argc, char *argv[]) {
         case 'd':
             diff_so_file = optarg;
             break;
+        case 'S':
+            parse_save_snapshot(optarg);
+            break;
+        case 'L':
+            load_snapshot_file = optarg;
+            break;
+        case 'r':
+            MUXDEF(CONFIG_MEM_REGION, parse_region(optarg),
+                   panic("memory regions are not enabled in menuconfig"));
+            break;
         case 1:
             img_file = optarg;
             return 0;
@@ -105,6 +170,15 @@ static int parse_args(int argc, char *argv[]) {
             printf("\t-d,--diff=REF_SO        run DiffTest with reference "
                    "REF_SO\n");
             printf("\t-p,--port=PORT          run DiffTest with port PORT\n");
+            printf("\t--save-snapshot=FILE[@N]\n");
+            printf("\t                        save the machine to FILE after "
+                   "N instructions,\n");
+            printf("\t                        or when NEMU exits\n");
+            printf("\t--load-snapshot=FILE    restore the machine from FILE "
+                   "instead of booting\n");
+            printf("\t--region=NAME,BASE,SIZE,ro|rw[,FILE]\n");
+            printf("\t                        add a ROM or RAM region, "
+                   "initialized from FILE\n");
             printf("\n");
             exit(0);
         }
@@ -124,6 +198,11 @@ void init_monitor(int argc, char *argv[]) {
     /* Open the log file. */
     init_log(log_file);
 
+    /* Batch mode runs the bare loop, unless the trace is written to a log file. */
+    if (batch_mode && !(MUXDEF(CONFIG_ITRACE_LOG, true, false) && log_file != NULL)) {
+        cpu_set_itrace(false);
+    }
+
     /* Initialize memory. */
     init_mem();
 
@@ -132,6 +211,7 @@ void init_monitor(int argc, char *argv[]) {
 
     /* Perform ISA dependent initialization. */
     init_isa();
+    init_cpu_snapshot();
 
     /* Load the image to memory. This will overwrite the built-in image. */
     long img_size = load_img();
@@ -139,6 +219,12 @@ void init_monitor(int argc, char *argv[]) {
     /* Initialize differential testing. */
     init_difftest(diff_so_file, img_size, difftest_port);
 
+    /* Restore the machine saved by a previous run. */
+    if (load_snapshot_file != NULL) {
+        bool ok = snapshot_load(load_snapshot_file);
+        Assert(ok, "Can not restore the snapshot");
+    }
+
     /* Initialize the simple debugger. */
     init_sdb();
 
@@ -0,0 +1,226 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+
+#include "sdb.h"
+#include <cpu/cpu.h>
+#include <isa.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// A checkpoint is a forked copy of NEMU blocked on reading its pipe, which
+// shares pmem and io_space with the running NEMU copy-on-write. Rewinding
+// writes the target instruction count to the pipe, then the checkpoint
+// replays to the target and becomes the running NEMU, while the process
+// which rewinds exits with HANDOVER_STATUS.
+//
+// Once checkpoints are enabled, the process started by the user becomes a
+// supervisor. It adopts the orphaned NEMU processes, waits for the one
+// which really exits, kills the remaining checkpoints and forwards the exit
+// status, so that the shell does not see NEMU exit at a rewind.
+
+#define HANDOVER_STATUS 0x7e
+
+typedef struct {
+    pid_t pid;
+    int fd; // the write end of the pipe which the checkpoint is blocked on
+    uint64_t nr_inst;
+} Checkpoint;
+
+extern HART_LOCAL uint64_t g_nr_guest_inst;
+
+static Checkpoint pool[CONFIG_CHECKPOINT_MAX] = {};
+static int nr_checkpoint = 0; // ordered from old to new
+static uint64_t interval = 0; // 0 if disabled
+static uint64_t next_checkpoint = 0;
+static bool supervised = false;
+
+static void supervise(pid_t nemu) {
+    int status = 0;
+    pid_t pid;
+    while ((pid = wait(&status)) > 0) {
+        // dropped checkpoints are killed by SIGKILL
+        if ((WIFEXITED(status) && WEXITSTATUS(status) == HANDOVER_STATUS) ||
+            (WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL))
+            continue;
+        break;
+    }
+    kill(-nemu, SIGKILL);
+    if (isatty(STDIN_FILENO))
+        tcsetpgrp(STDIN_FILENO, getpgrp());
+    _exit(pid > 0 && WIFEXITED(status) ? WEXITSTATUS(status) : 1);
+}
+
+static void start_supervisor() {
+    prctl(PR_SET_CHILD_SUBREAPER, 1);
+    fflush(NULL);
+    pid_t pid = fork();
+    Assert(pid >= 0, "Can not fork the supervisor");
+    // NEMU runs in its own process group, which is killed as a whole
+    setpgid(pid, pid);
+    if (pid > 0) {
+        if (isatty(STDIN_FILENO)) {
+            signal(SIGTTOU, SIG_IGN);
+            tcsetpgrp(STDIN_FILENO, pid);
+            // in case it has been stopped by reading the terminal too early
+            kill(-pid, SIGCONT);
+        }
+        supervise(pid);
+    }
+    prctl(PR_SET_CHILD_SUBREAPER, 0);
+    // dropped checkpoints are reaped automatically
+    signal(SIGCHLD, SIG_IGN);
+    // waking up a dropped checkpoint fails with EPIPE
+    signal(SIGPIPE, SIG_IGN);
+}
+
+static void drop_checkpoint(int i) {
+    kill(pool[i].pid, SIGKILL);
+    close(pool[i].fd);
+    memmove(&pool[i], &pool[i + 1], sizeof(pool[0]) * (nr_checkpoint - i - 1));
+    nr_checkpoint--;
+}
+
+// Return true in a checkpoint woken up by a rewind, with the instruction
+// count to replay to in `target`, or false in the running NEMU.
+static bool take_checkpoint(uint64_t *target) {
+    if (nr_checkpoint == CONFIG_CHECKPOINT_MAX)
+        drop_checkpoint(0);
+    int fd[2];
+    if (pipe(fd) != 0) {
+        printf("Can not create the pipe for a checkpoint\n");
+        return false;
+    }
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fd[1]);
+        ssize_t ret;
+        do {
+            ret = read(fd[0], target, sizeof(*target));
+        } while (ret < 0 && errno == EINTR);
+        if (ret != sizeof(*target))
+            _exit(0);
+        close(fd[0]);
+        // forget the older checkpoints dropped by other NEMU processes
+        int i;
+        for (i = nr_checkpoint - 1; i >= 0; i--) {
+            if (kill(pool[i].pid, 0) != 0)
+                drop_checkpoint(i);
+        }
+        return true;
+    }
+    close(fd[0]);
+    if (pid < 0) {
+        close(fd[1]);
+        printf("Can not fork a checkpoint\n");
+        return false;
+    }
+    pool[nr_checkpoint++] = (Checkpoint){pid, fd[1], g_nr_guest_inst};
+    return false;
+}
+
+// cpu_exec(n) with checkpoints taken on the way
+void checkpoint_exec(uint64_t n) {
+    while (true) {
+        if (interval > 0 && nemu_state.state == NEMU_STOP &&
+            g_nr_guest_inst >= next_checkpoint) {
+            uint64_t from = g_nr_guest_inst, target, replay_to = 0;
+            bool woken = false;
+            next_checkpoint = g_nr_guest_inst + interval;
+            // a woken checkpoint is used up, so it takes a new one at the
+            // same point before replaying, which may be rewound to again
+            while (take_checkpoint(&target)) {
+                woken = true;
+                replay_to = target;
+            }
+            if (woken) {
+                printf("Rewound to the checkpoint at instruction %" PRIu64
+                       ", replay %" PRIu64 " instructions\n",
+                       from, replay_to - from);
+                checkpoint_exec(replay_to - from);
+                return;
+            }
+        }
+        if (n == 0)
+            return;
+        uint64_t step = n;
+        if (interval > 0 && next_checkpoint - g_nr_guest_inst < step)
+            step = next_checkpoint - g_nr_guest_inst;
+        uint64_t start = g_nr_guest_inst;
+        cpu_exec(step);
+        uint64_t nr = g_nr_guest_inst - start;
+        n -= nr;
+        // the guest has ended, or has been stopped by a watchpoint
+        if (nemu_state.state != NEMU_STOP || nr < step)
+            return;
+    }
+}
+
+void checkpoint_set_interval(uint64_t n) {
+    if (n > 0 && !supervised) {
+        start_supervisor();
+        supervised = true;
+    }
+    if (n == 0) {
+        while (nr_checkpoint > 0)
+            drop_checkpoint(nr_checkpoint - 1);
+    }
+    interval = n;
+    // take one at the current instruction
+    next_checkpoint = g_nr_guest_inst;
+}
+
+void checkpoint_rewind(uint64_t target) {
+    if (target >= g_nr_guest_inst) {
+        checkpoint_exec(target - g_nr_guest_inst);
+        return;
+    }
+    while (true) {
+        int i = nr_checkpoint - 1;
+        while (i >= 0 && pool[i].nr_inst > target)
+            i--;
+        if (i < 0)
+            break;
+        if (write(pool[i].fd, &target, sizeof(target)) == sizeof(target)) {
+            // the checkpoints after it belong to the abandoned future
+            while (nr_checkpoint > i + 1)
+                drop_checkpoint(nr_checkpoint - 1);
+            fflush(NULL);
+            _exit(HANDOVER_STATUS);
+        }
+        // it has been dropped by another NEMU after this one was forked
+        drop_checkpoint(i);
+    }
+    printf("No checkpoint at or before instruction %" PRIu64 "\n", target);
+}
+
+void checkpoint_display() {
+    if (interval == 0) {
+        printf("Checkpoints are disabled\n");
+        return;
+    }
+    printf("A checkpoint every %" PRIu64 " instructions, now at instruction "
+           "%" PRIu64 "\n",
+           interval, g_nr_guest_inst);
+    int i;
+    for (i = 0; i < nr_checkpoint; i++) {
+        printf("#%d at instruction %" PRIu64 " (pid %d)\n", i, pool[i].nr_inst,
+               pool[i].pid);
+    }
+}
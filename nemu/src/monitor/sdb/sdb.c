@@ -15,14 +15,20 @@
 
 #include "sdb.h"
 #include <cpu/cpu.h>
+#include <cpu/difftest.h>
 #include <isa.h>
+#include <memory/paddr.h>
+#include <memory/region.h>
 #include <readline/history.h>
 #include <readline/readline.h>
 
 static int is_batch_mode = false;
+static const char *save_snapshot_file = NULL;
+static uint64_t save_snapshot_inst = 0;
 
 void init_regex();
 void init_wp_pool();
+void io_display();
 
 /* We use the `readline' library to provide more flexibility to read from stdin.
  */
@@ -44,7 +50,7 @@ static char *rl_gets() {
 }
 
 static int cmd_c(char *args) {
-    cpu_exec(-1);
+    checkpoint_exec(-1);
     return 0;
 }
 
@@ -54,7 +60,7 @@ static int cmd_q(char *args) {
 }
 
 static int cmd_si(char *args) {
-    cpu_exec(args ? atoi(args) : 1);
+    checkpoint_exec(args ? atoi(args) : 1);
     return 0;
 }
 
@@ -71,6 +77,31 @@ static int cmd_info(char *args) {
         case ('w'):
             print_wp();
             break;
+        case ('c'):
+            checkpoint_display();
+            break;
+        case ('m'):
+#ifdef CONFIG_MEM_REGION
+            mem_region_display();
+#else
+            printf("Memory regions are not enabled in menuconfig\n");
+#endif
+            break;
+        case ('i'):
+            if (strcmp(args, "io") == 0) {
+#ifdef CONFIG_DEVICE
+                io_display();
+#else
+                printf("Devices are not enabled in menuconfig\n");
+#endif
+                break;
+            }
+#ifdef CONFIG_ITRACE
+            iringbuf_display();
+#else
+            printf("Instruction trace is not enabled in menuconfig\n");
+#endif
+            break;
         default:
             printf("Unknow option '%c'\n", args[0]);
             break;
@@ -81,28 +112,34 @@ static int cmd_info(char *args) {
 
 static int cmd_x(char *args) {
     if (!args) {
-        printf("Usage: info [N] [EXPR]\n");
+        printf("Usage: x N ADDR\n");
         return 1;
     }
 
     paddr_t addr_mem;
     int n;
-    sscanf(args, "%u %x", &n, &addr_mem);
-    if (addr_mem < (paddr_t)CONFIG_MBASE ||
-        addr_mem > (paddr_t)CONFIG_MBASE + CONFIG_MSIZE - 1) {
+    if (sscanf(args, "%d %x", &n, &addr_mem) != 2 || n <= 0) {
+        printf("Usage: x N ADDR\n");
+        return 1;
+    }
+    uint32_t *buf = malloc(n * sizeof(uint32_t));
+    assert(buf);
+    if (!paddr_peek_block(addr_mem, buf, n * sizeof(uint32_t))) {
         printf("Please enter the correct address.\n");
+        free(buf);
         return 2;
     }
     for (int i = 0; i < n; i++) {
         if (i % 4 == 0) {
             printf("0x%08x: ", addr_mem);
         }
-        isa_mmu_translate(addr_mem, 4, 0);
+        printf("0x%08x ", buf[i]);
         addr_mem += 4;
         if (i % 4 == 3 || i == n - 1) {
             printf("\n");
         }
     }
+    free(buf);
     return 0;
 }
 
@@ -146,6 +183,77 @@ static int cmd_d(char *args) {
     return 0;
 }
 
+static int cmd_trace(char *args) {
+    if (args == NULL ||
+        (strcmp(args, "on") != 0 && strcmp(args, "off") != 0)) {
+        printf("Usage: trace on|off\n");
+        return 1;
+    }
+#ifdef CONFIG_ITRACE
+    cpu_set_itrace(strcmp(args, "on") == 0);
+#else
+    printf("Instruction trace is not enabled in menuconfig\n");
+#endif
+    return 0;
+}
+
+static int cmd_attach(char *args) {
+#ifdef CONFIG_DIFFTEST
+    difftest_attach();
+#else
+    printf("Differential testing is not enabled in menuconfig\n");
+#endif
+    return 0;
+}
+
+static int cmd_detach(char *args) {
+    difftest_detach();
+    return 0;
+}
+
+static int cmd_save(char *args) {
+    if (args == NULL) {
+        printf("Usage: save FILE\n");
+        return 1;
+    }
+    snapshot_save(args);
+    return 0;
+}
+
+static int cmd_load(char *args) {
+    if (args == NULL) {
+        printf("Usage: load FILE\n");
+        return 1;
+    }
+    snapshot_load(args);
+    return 0;
+}
+
+static int cmd_checkpoint(char *args) {
+    char *end = NULL;
+    uint64_t n = (args ? strtoull(args, &end, 0) : 0);
+    if (args != NULL && strcmp(args, "off") == 0) {
+        checkpoint_set_interval(0);
+    } else if (args == NULL || *end != '\0' || n == 0) {
+        printf("Usage: checkpoint N|off\n");
+        return 1;
+    } else {
+        checkpoint_set_interval(n);
+    }
+    return 0;
+}
+
+static int cmd_rewind(char *args) {
+    char *end = NULL;
+    uint64_t n = (args ? strtoull(args, &end, 0) : 0);
+    if (args == NULL || end == args || *end != '\0') {
+        printf("Usage: rewind N\n");
+        return 1;
+    }
+    checkpoint_rewind(n);
+    return 0;
+}
+
 static int cmd_help(char *args);
 
 static struct {
@@ -161,7 +269,18 @@ static struct {
     {"x", "Scan the memroy", cmd_x},
     {"p", "Compute the expression", cmd_p},
     {"w", "Set the watcher", cmd_w},
-    {"d", "Delete the watcher", cmd_d}
+    {"d", "Delete the watcher", cmd_d},
+    {"trace", "Turn the instruction trace on or off", cmd_trace},
+    {"attach", "Attach to the reference of differential testing",
+     cmd_attach},
+    {"detach", "Detach from the reference of differential testing",
+     cmd_detach},
+    {"save", "Save the machine to a snapshot file", cmd_save},
+    {"load", "Restore the machine from a snapshot file", cmd_load},
+    {"checkpoint", "Fork a checkpoint every N instructions, or stop with off",
+     cmd_checkpoint},
+    {"rewind", "Go back to instruction N from the nearest checkpoint",
+     cmd_rewind}
 
     /* TODO: Add more commands */
 
@@ -194,7 +313,34 @@ static int cmd_help(char *args) {
 
 void sdb_set_batch_mode() { is_batch_mode = true; }
 
+void sdb_set_save_snapshot(const char *path, uint64_t nr_inst) {
+    save_snapshot_file = path;
+    save_snapshot_inst = nr_inst;
+}
+
+static void sdb_loop();
+
 void sdb_mainloop() {
+    if (save_snapshot_file != NULL && save_snapshot_inst > 0) {
+        cpu_exec(save_snapshot_inst);
+        if (nemu_state.state == NEMU_STOP)
+            snapshot_save(save_snapshot_file);
+        else
+            printf("The program ended before the snapshot was saved\n");
+        save_snapshot_file = NULL;
+    }
+
+    sdb_loop();
+
+    if (save_snapshot_file != NULL) {
+        if (nemu_state.state == NEMU_STOP || nemu_state.state == NEMU_QUIT)
+            snapshot_save(save_snapshot_file);
+        else
+            printf("The program has ended, the snapshot is not saved\n");
+    }
+}
+
+static void sdb_loop() {
     if (is_batch_mode) {
         cmd_c(NULL);
         return;
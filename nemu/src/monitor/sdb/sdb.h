@@ -23,6 +23,12 @@ word_t expr(char *e, bool *success);
 int set_wp(char *expression);
 int delete_wp(int n);
 bool if_expr_change();
+bool wp_exist();
 void print_wp();
 
+void checkpoint_exec(uint64_t n);
+void checkpoint_set_interval(uint64_t n);
+void checkpoint_rewind(uint64_t target);
+void checkpoint_display();
+
 #endif
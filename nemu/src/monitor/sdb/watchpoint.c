@@ -112,6 +112,8 @@ int delete_wp(int n) {
     return 0;
 }
 
+bool wp_exist() { return head != NULL; }
+
 bool if_expr_change() {
     WP *wp;
     bool flag = false;
@@ -0,0 +1,298 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+
+#include <isa.h>
+#include <cpu/difftest.h>
+#include <cpu/invalidate.h>
+#include <memory/paddr.h>
+#include <memory/vaddr.h>
+
+// A snapshot file holds a header, the section table, the list of non-zero
+// runs of pmem pages, the data of the sections, and then the pages of the
+// runs at page aligned offsets. Everything is found by offsets from the
+// start of the file, so it is used through mmap() while restoring, and the
+// pages of pmem are mapped copy-on-write instead of being read.
+
+#define SNAPSHOT_MAGIC "NEMUSNAP"
+#define SNAPSHOT_VERSION 1
+#define NR_SECTION 32
+#define SECTION_NAME_LEN 32
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t nr_section;
+    char isa[16];
+    uint64_t mbase, msize;
+    uint64_t nr_run;
+    uint64_t time; // get_time() when saved, in us
+} SnapshotHeader;
+
+typedef struct {
+    char name[SECTION_NAME_LEN];
+    uint64_t offset, size;
+} SnapshotSection;
+
+typedef struct {
+    uint64_t addr, len; // guest physical address and length of the run
+    uint64_t offset;
+} SnapshotRun;
+
+typedef struct {
+    const char *name;
+    void *p;
+    size_t size;
+    void (*sync)(bool restore);
+} Section;
+
+static Section sections[NR_SECTION] = {};
+static int nr_section = 0;
+
+void snapshot_add(const char *name, void *p, size_t size,
+                  void (*sync)(bool restore)) {
+    Assert(nr_section < NR_SECTION, "too many snapshot sections");
+    Assert(strlen(name) < SECTION_NAME_LEN, "section name %s is too long",
+           name);
+    sections[nr_section++] = (Section){name, p, size, sync};
+}
+
+#if defined(CONFIG_MODE_SYSTEM) && !defined(CONFIG_TARGET_AM)
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define NR_PAGE (CONFIG_MSIZE / PAGE_SIZE)
+
+static bool write_at(int fd, const void *buf, size_t len, off_t offset) {
+    const uint8_t *p = buf;
+    while (len > 0) {
+        ssize_t ret = pwrite(fd, p, len, offset);
+        if (ret <= 0)
+            return false;
+        p += ret;
+        len -= ret;
+        offset += ret;
+    }
+    return true;
+}
+
+// collect the runs of non-zero pages of pmem, return the number of runs
+static uint64_t collect_runs(SnapshotRun **runs) {
+    uint64_t nr_run = 0, max_run = 16;
+    SnapshotRun *r = malloc(sizeof(*r) * max_run);
+    assert(r);
+    uint64_t i = 0;
+    while (i < NR_PAGE) {
+        if (pmem_page_is_zero(PMEM_LEFT + i * PAGE_SIZE)) {
+            i++;
+            continue;
+        }
+        uint64_t start = i;
+        while (i < NR_PAGE && !pmem_page_is_zero(PMEM_LEFT + i * PAGE_SIZE))
+            i++;
+        if (nr_run == max_run) {
+            max_run *= 2;
+            r = realloc(r, sizeof(*r) * max_run);
+            assert(r);
+        }
+        r[nr_run++] = (SnapshotRun){PMEM_LEFT + start * PAGE_SIZE,
+                                    (i - start) * PAGE_SIZE, 0};
+    }
+    *runs = r;
+    return nr_run;
+}
+
+bool snapshot_save(const char *path) {
+    int i;
+    for (i = 0; i < nr_section; i++) {
+        if (sections[i].sync != NULL)
+            sections[i].sync(false);
+    }
+
+    SnapshotRun *runs = NULL;
+    uint64_t nr_run = collect_runs(&runs);
+    SnapshotHeader h = {.magic = SNAPSHOT_MAGIC,
+                        .version = SNAPSHOT_VERSION,
+                        .nr_section = nr_section,
+                        .isa = str(__GUEST_ISA__),
+                        .mbase = CONFIG_MBASE,
+                        .msize = CONFIG_MSIZE,
+                        .nr_run = nr_run,
+                        .time = get_time()};
+    SnapshotSection table[NR_SECTION] = {};
+    uint64_t offset = sizeof(h) + sizeof(table[0]) * nr_section +
+                      sizeof(runs[0]) * nr_run;
+    for (i = 0; i < nr_section; i++) {
+        strcpy(table[i].name, sections[i].name);
+        table[i].offset = offset = ROUNDUP(offset, 8);
+        table[i].size = sections[i].size;
+        offset += sections[i].size;
+    }
+    uint64_t j;
+    for (j = 0; j < nr_run; j++) {
+        runs[j].offset = offset = ROUNDUP(offset, PAGE_SIZE);
+        offset += runs[j].len;
+    }
+
+    // A restored snapshot may still back pmem, so the old file is replaced
+    // by renaming instead of being truncated under the mapping.
+    char tmp[strlen(path) + 5];
+    sprintf(tmp, "%s.tmp", path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool ok = (fd >= 0);
+    ok = ok && write_at(fd, &h, sizeof(h), 0);
+    ok = ok && write_at(fd, table, sizeof(table[0]) * nr_section, sizeof(h));
+    ok = ok && write_at(fd, runs, sizeof(runs[0]) * nr_run,
+                        sizeof(h) + sizeof(table[0]) * nr_section);
+    for (i = 0; ok && i < nr_section; i++) {
+        ok = write_at(fd, sections[i].p, sections[i].size, table[i].offset);
+    }
+    for (j = 0; ok && j < nr_run; j++) {
+        ok = write_at(fd, guest_to_host(runs[j].addr), runs[j].len,
+                      runs[j].offset);
+    }
+    ok = ok && ftruncate(fd, offset) == 0;
+    if (fd >= 0)
+        close(fd);
+    ok = ok && rename(tmp, path) == 0;
+    free(runs);
+
+    if (!ok) {
+        printf("Can not save the snapshot to '%s': %s\n", path,
+               strerror(errno));
+        unlink(tmp);
+        return false;
+    }
+    Log("Snapshot saved to %s, %" PRIu64 " runs of pmem pages, %" PRIu64
+        " bytes",
+        path, nr_run, offset);
+    return true;
+}
+
+static const SnapshotSection *find_section(const SnapshotHeader *h,
+                                           const char *name) {
+    const SnapshotSection *table = (const SnapshotSection *)(h + 1);
+    uint32_t i;
+    for (i = 0; i < h->nr_section; i++) {
+        if (strncmp(table[i].name, name, SECTION_NAME_LEN) == 0)
+            return &table[i];
+    }
+    return NULL;
+}
+
+// check the snapshot against this NEMU before any state is changed
+static const char *check_snapshot(const SnapshotHeader *h, size_t size) {
+    if (size < sizeof(*h) || memcmp(h->magic, SNAPSHOT_MAGIC, 8) != 0)
+        return "not a snapshot";
+    if (h->version != SNAPSHOT_VERSION)
+        return "unsupported version";
+    if (strncmp(h->isa, str(__GUEST_ISA__), sizeof(h->isa)) != 0 ||
+        h->mbase != CONFIG_MBASE || h->msize != CONFIG_MSIZE)
+        return "saved by another ISA or with another pmem";
+    if (h->nr_section > NR_SECTION ||
+        sizeof(*h) + sizeof(SnapshotSection) * h->nr_section +
+                sizeof(SnapshotRun) * h->nr_run >
+            size)
+        return "truncated";
+    int i;
+    for (i = 0; i < nr_section; i++) {
+        const SnapshotSection *s = find_section(h, sections[i].name);
+        if (s == NULL || s->size != sections[i].size ||
+            s->offset + s->size > size)
+            return "saved with other devices or options";
+    }
+    const SnapshotRun *runs =
+        (const SnapshotRun *)((const SnapshotSection *)(h + 1) +
+                              h->nr_section);
+    uint64_t j;
+    for (j = 0; j < h->nr_run; j++) {
+        const SnapshotRun *r = &runs[j];
+        if (r->addr < PMEM_LEFT || r->len > CONFIG_MSIZE ||
+            r->addr - PMEM_LEFT > CONFIG_MSIZE - r->len ||
+            r->offset % PAGE_SIZE != 0 || r->offset + r->len > size)
+            return "truncated";
+    }
+    return NULL;
+}
+
+bool snapshot_load(const char *path) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        printf("Can not open the snapshot '%s': %s\n", path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+    const SnapshotHeader *h =
+        mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    const char *err = (h == MAP_FAILED ? strerror(errno)
+                                       : check_snapshot(h, st.st_size));
+    if (err != NULL) {
+        printf("Can not load the snapshot '%s': %s\n", path, err);
+        if (h != MAP_FAILED)
+            munmap((void *)h, st.st_size);
+        close(fd);
+        return false;
+    }
+
+    pmem_reset();
+    const SnapshotRun *runs =
+        (const SnapshotRun *)((const SnapshotSection *)(h + 1) +
+                              h->nr_section);
+    uint64_t j;
+    for (j = 0; j < h->nr_run; j++) {
+        bool ok = pmem_load_file(runs[j].addr, runs[j].len, fd, runs[j].offset);
+        Assert(ok, "failed to load pmem from the snapshot '%s'", path);
+    }
+    int i;
+    for (i = 0; i < nr_section; i++) {
+        const SnapshotSection *s = find_section(h, sections[i].name);
+        memcpy(sections[i].p, (const uint8_t *)h + s->offset, s->size);
+        if (sections[i].sync != NULL)
+            sections[i].sync(true);
+    }
+    set_time(h->time);
+    Log("Snapshot loaded from %s, %" PRIu64 " runs of pmem pages", path,
+        h->nr_run);
+    munmap((void *)h, st.st_size);
+    close(fd);
+
+    // nothing translated or cached from the old state is valid
+    code_invalidate_all();
+    tlb_flush();
+#ifdef CONFIG_DEVICE
+    extern HART_LOCAL uint64_t g_device_deadline;
+    g_device_deadline = 0;
+#endif
+    if (difftest_is_attached())
+        difftest_attach();
+    nemu_state.state = NEMU_STOP;
+    return true;
+}
+#else
+bool snapshot_save(const char *path) {
+    printf("Snapshots are not supported\n");
+    return false;
+}
+
+bool snapshot_load(const char *path) {
+    printf("Snapshots are not supported\n");
+    return false;
+}
+#endif
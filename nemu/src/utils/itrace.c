@@ -0,0 +1,63 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <common.h>
+
+#ifdef CONFIG_ITRACE
+IRingBufEntry iringbuf[CONFIG_IRINGBUF_SIZE] = {};
+uint64_t iringbuf_nr = 0;
+
+void disassemble(char *str, int size, uint64_t pc, uint8_t *code, int nbyte);
+
+// format an instruction as "pc: raw bytes  assembly"
+void itrace_disasm(char *buf, int size, vaddr_t pc, uint32_t inst, int ilen) {
+  char *p = buf;
+  p += snprintf(p, size, FMT_WORD ":", pc);
+  int i;
+  uint8_t *code = (uint8_t *)&inst;
+  for (i = ilen - 1; i >= 0; i --) {
+    p += snprintf(p, 4, " %02x", code[i]);
+  }
+  int ilen_max = MUXDEF(CONFIG_ISA_x86, 8, 4);
+  int space_len = ilen_max - ilen;
+  if (space_len < 0) space_len = 0;
+  space_len = space_len * 3 + 1;
+  memset(p, ' ', space_len);
+  p += space_len;
+
+#ifndef CONFIG_ISA_loongarch32r
+  disassemble(p, buf + size - p, MUXDEF(CONFIG_ISA_x86, pc + ilen, pc), code, ilen);
+#else
+  p[0] = '\0'; // the upstream llvm does not support loongarch32r
+#endif
+}
+
+// disassemble the instructions in the ring buffer, the last one is marked
+void iringbuf_display() {
+  if (iringbuf_nr == 0) return;
+  uint64_t nr = (iringbuf_nr < CONFIG_IRINGBUF_SIZE ? iringbuf_nr : CONFIG_IRINGBUF_SIZE);
+  uint64_t i;
+  char buf[128];
+  for (i = iringbuf_nr - nr; i < iringbuf_nr; i ++) {
+    IRingBufEntry *e = &iringbuf[i % CONFIG_IRINGBUF_SIZE];
+    itrace_disasm(buf, sizeof(buf), e->pc, e->inst, e->ilen);
+    word_t offset;
+    const char *sym = symbol_lookup(e->pc, &offset);
+    printf("%s %s", (i == iringbuf_nr - 1 ? "-->" : "   "), buf);
+    if (sym != NULL) printf("  <%s+0x%" PRIx64 ">", sym, (uint64_t)offset);
+    printf("\n");
+  }
+}
+#endif
@@ -45,4 +45,20 @@ uint64_t get_time() {
     return now - boot_time;
 }
 
+// make get_time() continue from `us`, e.g. after restoring a snapshot
+void set_time(uint64_t us) { boot_time = get_time_internal() - us; }
+
+// The time seen by the guest. With CONFIG_ICOUNT it is derived from the
+// number of executed instructions, so it does not depend on the host.
+uint64_t get_guest_time() {
+#ifdef CONFIG_ICOUNT
+    extern HART_LOCAL uint64_t g_nr_guest_inst;
+    uint64_t sec = g_nr_guest_inst / CONFIG_ICOUNT_FREQ;
+    uint64_t rem = g_nr_guest_inst % CONFIG_ICOUNT_FREQ;
+    return sec * 1000000 + rem * 1000000 / CONFIG_ICOUNT_FREQ;
+#else
+    return get_time();
+#endif
+}
+
 void init_rand() { srand(get_time_internal()); }